@@ -0,0 +1,69 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "adpcm.h"
+
+static const int16_t step_table[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+	253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+	1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+	3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+	12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+};
+
+static const int8_t index_table[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8,
+};
+
+static int16_t decode_nibble(struct adpcm_state *state, uint8_t nibble)
+{
+	int32_t step = step_table[state->index];
+	int32_t diff = step >> 3;
+
+	if (nibble & 1) {
+		diff += step >> 2;
+	}
+	if (nibble & 2) {
+		diff += step >> 1;
+	}
+	if (nibble & 4) {
+		diff += step;
+	}
+	int32_t predictor = state->predictor + ((nibble & 8) ? -diff : diff);
+	state->predictor = CLAMP(predictor, INT16_MIN, INT16_MAX);
+	state->index = CLAMP(state->index + index_table[nibble], 0, ARRAY_SIZE(step_table) - 1);
+	return state->predictor;
+}
+
+void adpcm_start(struct adpcm_state *state, const uint8_t *data, uint32_t first)
+{
+	state->block = data + (first / ADPCM_SAMPLES_PER_BLOCK) * ADPCM_BLOCK_SIZE;
+	state->sample = 0;
+	adpcm_decode(state, NULL, first % ADPCM_SAMPLES_PER_BLOCK);
+}
+
+void adpcm_decode(struct adpcm_state *state, int16_t *out, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		int16_t sample;
+
+		if (state->sample == 0) {
+			state->predictor = sys_get_le16(state->block);
+			state->index = MIN(state->block[2], ARRAY_SIZE(step_table) - 1);
+			sample = state->predictor;
+		} else {
+			/* Low nibble first */
+			uint8_t byte = state->block[4 + (state->sample - 1) / 2];
+			sample = decode_nibble(state, (state->sample & 1) ? byte & 0x0f : byte >> 4);
+		}
+		if (out != NULL) {
+			out[i] = sample;
+		}
+		if (++state->sample == ADPCM_SAMPLES_PER_BLOCK) {
+			state->sample = 0;
+			state->block += ADPCM_BLOCK_SIZE;
+		}
+	}
+}
@@ -0,0 +1,28 @@
+#ifndef __ADPCM_H__
+#define __ADPCM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* IMA ADPCM, laid out like the blocks in a mono IMA ADPCM wav: each block
+ * starts with the first sample and step index in full, so decoding can
+ * start at any block.  tools/mkclip.py does the encoding.
+ */
+#define ADPCM_BLOCK_SIZE 256
+#define ADPCM_SAMPLES_PER_BLOCK ((ADPCM_BLOCK_SIZE - 4) * 2 + 1)
+
+struct adpcm_state {
+	const uint8_t *block;
+	/* Samples of the current block already decoded */
+	uint16_t sample;
+	int16_t predictor;
+	uint8_t index;
+};
+
+/* Get ready to decode from sample first of the blocks at data */
+void adpcm_start(struct adpcm_state *state, const uint8_t *data, uint32_t first);
+
+/* Decode the next count samples into out, or skip them if out is NULL */
+void adpcm_decode(struct adpcm_state *state, int16_t *out, size_t count);
+
+#endif // __ADPCM_H__
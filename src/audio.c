@@ -1,9 +1,18 @@
+#include <string.h>
 #include <zephyr/drivers/i2s.h>
 #include <zephyr/fs/fs.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/pm/device_runtime.h>
 
+#include "adpcm.h"
 #include "audio.h"
+#include "pack.h"
+#include "power.h"
+
+#if defined(__ARM_FEATURE_SIMD32)
+#include <arm_acle.h>
+#endif
 
 #define SAMPLE_FREQUENCY    44100
 #define SAMPLE_BIT_WIDTH    16
@@ -11,11 +20,13 @@
 #define NUMBER_OF_CHANNELS  1
 /* Such block length provides delay of 100 ms. */
 #define SAMPLES_PER_BLOCK   ((SAMPLE_FREQUENCY / 10) * NUMBER_OF_CHANNELS)
+#define BLOCK_MS            100
 #define INITIAL_BLOCKS      2
 #define TIMEOUT             1000
 
 
 #define BLOCK_SIZE  (BYTES_PER_SAMPLE * SAMPLES_PER_BLOCK)
+BUILD_ASSERT(BLOCK_SIZE == AUDIO_BLOCK_SIZE, "audio.h is out of step with the block format");
 #define BLOCK_COUNT (INITIAL_BLOCKS + 2)
 K_MEM_SLAB_DEFINE_STATIC(mem_slab, BLOCK_SIZE, BLOCK_COUNT, 4);
 
@@ -23,90 +34,673 @@ K_MEM_SLAB_DEFINE_STATIC(mem_slab, BLOCK_SIZE, BLOCK_COUNT, 4);
 
 LOG_MODULE_DECLARE(bmbb);
 
-/* Define the thread to play audio */
+/* The reader fills and mixes blocks from the files at a low priority, the
+ * writer only hands finished blocks to the I2S so it runs above everything
+ * else in the app.
+ */
 #define AUDIO_STACK_SIZE 2048
 K_THREAD_STACK_DEFINE(audio_stack_area, AUDIO_STACK_SIZE);
 struct k_thread audio_thread_data;
 
+#define WRITER_STACK_SIZE 1024
+K_THREAD_STACK_DEFINE(writer_stack_area, WRITER_STACK_SIZE);
+struct k_thread writer_thread_data;
+
+/* Filled blocks on their way from the reader to the writer.  A NULL block
+ * marks the end of the stream.
+ */
+struct audio_block {
+	void *data;
+	size_t len;
+};
+K_MSGQ_DEFINE(block_queue, sizeof(struct audio_block), BLOCK_COUNT + 1, 4);
+
+/* How long a wake from audio_prepare() waits for its play before the I2S
+ * goes back to sleep, longer than the button takes to report a short press
+ */
+#define PREPARE_HOLD K_SECONDS(3)
+
+static void unprepare_handler(struct k_work *work);
+
+/* Statically defined so audio_prepare() can be called before audio_init() */
+K_MUTEX_DEFINE(i2s_pm_lock);
+K_WORK_DELAYABLE_DEFINE(i2s_unprepare, unprepare_handler);
+
+/* How often the writer checks the I2S queue depth while waiting on the reader */
+#define WATCHDOG_PERIOD_MS (BLOCK_MS / 2)
+
+/* Stream 0 is the song, the rest are for one-shot effects mixed over it */
+#define SONG_STREAM 0
+
+enum stream_state {
+	STREAM_FREE,
+	STREAM_OPENING,
+	STREAM_ACTIVE,
+};
+
+enum source_type {
+	SOURCE_FILE,
+	SOURCE_PACK,
+	SOURCE_MEMORY,
+	SOURCE_ADPCM,
+};
+
+/* Where a stream's samples come from.  Everything but a file keeps count of
+ * the sample bytes left, a file just runs to its end.
+ */
+struct audio_source {
+	enum source_type type;
+	struct fs_file_t file;
+	uint32_t pack_pos;
+	const uint8_t *data;
+#if defined(CONFIG_APP_DEFAULT_SONG_ADPCM)
+	struct adpcm_state adpcm;
+#endif
+	uint32_t remaining;
+};
+
+struct audio_stream {
+	volatile enum stream_state state;
+	struct audio_source src;
+	int16_t gain;
+	/* Holding the SD card awake while the file is open */
+	bool disk_ref;
+};
+
 static struct {
 	const struct device *i2s_dev;
 	k_tid_t tid;
-	bool cancel;
-	void *mem_block[BLOCK_COUNT];
-	struct fs_file_t file;
+	k_tid_t writer_tid;
+	volatile bool cancel;
+	bool running;
+	struct k_mutex lock;
+	struct audio_stream streams[AUDIO_MAX_STREAMS];
+	/* Set while the reader holds a block that isn't in the queue yet */
+	atomic_t reader_holding;
 	int64_t start_timestamp;
+	/* Where in the song playback was started from */
+	uint32_t start_offset_ms;
+	/* Runtime PM is set up for the I2S */
+	bool pm_ready;
+	/* audio_prepare() holds an I2S reference for the next stream */
+	bool prepared;
+	struct audio_stats stats;
 } s_ctx;
 
-void handle_playback(void *, void *, void *)
+/* Scratch block the effect streams are read into before mixing */
+static int16_t s_mix_buf[SAMPLES_PER_BLOCK] __aligned(4);
+
+static inline int16_t sat16(int32_t sample)
 {
-	int ret;
-	size_t len;
+	if (sample > INT16_MAX) {
+		return INT16_MAX;
+	} else if (sample < INT16_MIN) {
+		return INT16_MIN;
+	}
+	return sample;
+}
 
-	/* Apparently need to pre-fill the i2s before starting it */
-	len = fs_read(&s_ctx.file, s_ctx.mem_block[0], BLOCK_SIZE);
-	if (len < 0) {
-		LOG_ERR("Failed to read from wav file: %d", len);
-		goto done;
-	} else if (len > 0) {
-		/* Write the block to the I2S (blocking) */
-		ret = i2s_write(s_ctx.i2s_dev, s_ctx.mem_block[0], len);
-		if (ret < 0) {
-			LOG_ERR("Failed to write wav block: %d", ret);
-			goto done;
+static void apply_gain(int16_t *samples, size_t count, int16_t gain)
+{
+	if (gain == AUDIO_GAIN_UNITY) {
+		return;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		samples[i] = ((int32_t)samples[i] * gain) >> 15;
+	}
+}
+
+/* dst += src, saturating.  Uses the DSP extension to add two samples per
+ * instruction where the core has it (the nRF52840's Cortex-M4 does).
+ */
+static void mix_add(int16_t *dst, const int16_t *src, size_t count)
+{
+	size_t i = 0;
+
+#if defined(__ARM_FEATURE_SIMD32)
+	for (; i + 1 < count; i += 2) {
+		int16x2_t a, b;
+
+		memcpy(&a, &dst[i], sizeof(a));
+		memcpy(&b, &src[i], sizeof(b));
+		a = __qadd16(a, b);
+		memcpy(&dst[i], &a, sizeof(a));
+	}
+#endif
+	for (; i < count; ++i) {
+		dst[i] = sat16((int32_t)dst[i] + src[i]);
+	}
+}
+
+static void stream_release(struct audio_stream *stream)
+{
+	if (stream->src.type == SOURCE_FILE) {
+		fs_close(&stream->src.file);
+	}
+	if (stream->disk_ref) {
+		power_disk_put();
+		stream->disk_ref = false;
+	}
+}
+
+static void stream_close(struct audio_stream *stream)
+{
+	stream_release(stream);
+	k_mutex_lock(&s_ctx.lock, K_FOREVER);
+	stream->state = STREAM_FREE;
+	k_mutex_unlock(&s_ctx.lock);
+}
+
+static ssize_t source_read(struct audio_source *src, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	switch (src->type) {
+	case SOURCE_FILE:
+		return fs_read(&src->file, buf, len);
+	case SOURCE_PACK:
+		ret = pack_read(src->pack_pos, buf, MIN(len, src->remaining));
+		if (ret > 0) {
+			src->pack_pos += ret;
 		}
+		break;
+	case SOURCE_MEMORY:
+		/* The I2S can't DMA out of flash, so this one copy is all it takes */
+		ret = MIN(len, src->remaining);
+		memcpy(buf, src->data, ret);
+		src->data += ret;
+		break;
+#if defined(CONFIG_APP_DEFAULT_SONG_ADPCM)
+	case SOURCE_ADPCM:
+		ret = MIN(len, src->remaining) & ~(BYTES_PER_SAMPLE - 1);
+		adpcm_decode(&src->adpcm, buf, ret / BYTES_PER_SAMPLE);
+		break;
+#endif
+	default:
+		return -ENOTSUP;
 	}
-	k_yield();
+	if (ret > 0) {
+		src->remaining -= ret;
+	}
+	return ret;
+}
 
-	s_ctx.start_timestamp = k_uptime_get();
-	LOG_INF("Starting the stream at: %lld", s_ctx.start_timestamp);
+/* Fill a block with the sum of all active streams.  The first stream is
+ * read straight into the block so a lone song costs no extra copy.
+ *
+ * @return Number of bytes in the block, 0 once every stream has ended.
+ */
+static size_t mix_block(int16_t *block)
+{
+	size_t block_len = 0;
+	bool first = true;
 
-	/* Start the stream */
-	ret = i2s_trigger(s_ctx.i2s_dev, I2S_DIR_TX, I2S_TRIGGER_START);
-	if (ret < 0) {
-		LOG_ERR("Failed to start i2s stream: %d", ret);
-		goto done;
+	for (int i = 0; i < AUDIO_MAX_STREAMS; ++i) {
+		struct audio_stream *stream = &s_ctx.streams[i];
+		if (stream->state != STREAM_ACTIVE) {
+			continue;
+		}
+
+		int16_t *buf = first ? block : s_mix_buf;
+		ssize_t len = source_read(&stream->src, buf, BLOCK_SIZE);
+		if (len < 0) {
+			LOG_ERR("Failed to read from wav stream %d: %d", i, len);
+			len = 0;
+		}
+		len &= ~(BYTES_PER_SAMPLE - 1);
+
+		if (len > 0) {
+			size_t count = len / BYTES_PER_SAMPLE;
+			apply_gain(buf, count, stream->gain);
+			if (first) {
+				memset((uint8_t *)block + len, 0, BLOCK_SIZE - len);
+				first = false;
+			} else {
+				mix_add(block, buf, count);
+			}
+			block_len = MAX(block_len, len);
+		}
+
+		if (len < BLOCK_SIZE) {
+			/* End of file */
+			stream_close(stream);
+		} else {
+			/* Still going, keep the block full so the others line up */
+			block_len = BLOCK_SIZE;
+		}
 	}
+	return block_len;
+}
 
-	/* Fill with the rest */
-	int block_idx = 1;
-	do {
-		k_yield();
-		if (s_ctx.cancel) {
-			LOG_INF("audio transmit cancelled");
+/* Returns true if the thread should keep going, clearing running otherwise
+ * so the next caller of audio_play_effect() knows to start a new thread.
+ */
+static bool streams_remaining(void)
+{
+	bool remaining = false;
+
+	k_mutex_lock(&s_ctx.lock, K_FOREVER);
+	for (int i = 0; i < AUDIO_MAX_STREAMS; ++i) {
+		if (s_ctx.streams[i].state == STREAM_ACTIVE) {
+			remaining = true;
 			break;
 		}
+	}
+	if (!remaining) {
+		s_ctx.running = false;
+	}
+	k_mutex_unlock(&s_ctx.lock);
+	return remaining;
+}
 
-		/* Read a block from the file */
-		len = fs_read(&s_ctx.file, s_ctx.mem_block[block_idx], BLOCK_SIZE);
-		if (len < 0) {
-			LOG_ERR("Failed to read from wav file: %d", len);
+/* Blocks the I2S driver still has to clock out, including the current one.
+ * held is the number the writer has taken off the queue but not written yet.
+ */
+static int blocks_in_flight(int held)
+{
+	return k_mem_slab_num_used_get(&mem_slab) - k_msgq_num_used_get(&block_queue) -
+		atomic_get(&s_ctx.reader_holding) - held;
+}
+
+/* Underrun watchdog, the writer calls this whenever it wakes up.  Logging is
+ * deferred so the warning doesn't cost the writer anything.
+ */
+static void watchdog_check(int held)
+{
+	int queued = blocks_in_flight(held);
+
+	if (queued < s_ctx.stats.min_queued) {
+		s_ctx.stats.min_queued = queued;
+	}
+	if (queued <= CONFIG_APP_UNDERRUN_THRESHOLD) {
+		s_ctx.stats.near_underruns++;
+		LOG_WRN("I2S queue down to %d blocks", queued);
+	}
+}
+
+static void free_block(struct audio_block *blk)
+{
+	if (blk->data != NULL) {
+		k_mem_slab_free(&mem_slab, blk->data);
+	}
+}
+
+void handle_writer(void *, void *, void *)
+{
+	int ret;
+	struct audio_block blk;
+	bool started = false;
+	bool failed = false;
+	int prefilled = 0;
+	/* Milliseconds of audio given to the I2S before the current start */
+	int64_t played_ms = 0;
+
+	while (true) {
+		ret = k_msgq_get(&block_queue, &blk, started ? K_MSEC(WATCHDOG_PERIOD_MS) : K_FOREVER);
+		if (ret != 0) {
+			/* Reader is running late */
+			watchdog_check(0);
+			continue;
+		}
+		if (blk.data == NULL) {
 			break;
-		} else if (len > 0) {
-			/* Write the block to the I2S (blocking) */
-			ret = i2s_write(s_ctx.i2s_dev, s_ctx.mem_block[block_idx], len);
+		}
+		if (s_ctx.cancel || failed) {
+			free_block(&blk);
+			continue;
+		}
+		if (started) {
+			/* blk is off the queue but the driver doesn't have it yet */
+			watchdog_check(1);
+		}
+
+		ret = i2s_write(s_ctx.i2s_dev, blk.data, blk.len);
+		if (ret == -EIO && started) {
+			/* The queue ran dry and the driver stopped, restart from here */
+			s_ctx.stats.underruns++;
+			LOG_WRN("I2S underrun, restarting stream");
+			i2s_trigger(s_ctx.i2s_dev, I2S_DIR_TX, I2S_TRIGGER_PREPARE);
+			started = false;
+			prefilled = 0;
+			ret = i2s_write(s_ctx.i2s_dev, blk.data, blk.len);
+		}
+		if (ret < 0) {
+			LOG_ERR("Failed to write wav block of len %d: %d", blk.len, ret);
+			free_block(&blk);
+			failed = true;
+			s_ctx.cancel = true;
+			continue;
+		}
+
+		if (!started) {
+			/* Apparently need to pre-fill the i2s before starting it */
+			if (++prefilled < INITIAL_BLOCKS) {
+				played_ms += BLOCK_MS;
+				continue;
+			}
+			ret = i2s_trigger(s_ctx.i2s_dev, I2S_DIR_TX, I2S_TRIGGER_START);
 			if (ret < 0) {
-				LOG_ERR("Failed to write wav block %d of len %d: %d", block_idx, len, ret);
-				break;
+				LOG_ERR("Failed to start i2s stream: %d", ret);
+				failed = true;
+				s_ctx.cancel = true;
+				continue;
 			}
+			started = true;
+			/* Everything before this prefill has been heard already */
+			s_ctx.start_timestamp = k_uptime_get() - (played_ms - (prefilled - 1) * BLOCK_MS);
 		}
-		if (len < BLOCK_SIZE) {
-			/* End of file */
+		played_ms += BLOCK_MS;
+	}
+
+	if (!started && prefilled > 0 && !s_ctx.cancel) {
+		/* Short clip that never filled the prefill */
+		if (i2s_trigger(s_ctx.i2s_dev, I2S_DIR_TX, I2S_TRIGGER_START) == 0) {
+			started = true;
+			s_ctx.start_timestamp = k_uptime_get();
+		}
+	}
+
+	if (started && !s_ctx.cancel) {
+		/* Let the tail of the stream play out */
+		i2s_trigger(s_ctx.i2s_dev, I2S_DIR_TX, I2S_TRIGGER_DRAIN);
+		while (k_mem_slab_num_used_get(&mem_slab) > 0 && !s_ctx.cancel) {
+			k_msleep(BLOCK_MS / 10);
+		}
+	}
+	if (s_ctx.cancel) {
+		i2s_trigger(s_ctx.i2s_dev, I2S_DIR_TX, I2S_TRIGGER_DROP);
+	}
+}
+
+void handle_playback(void *, void *, void *)
+{
+	int ret;
+	size_t len;
+	bool drained = false;
+	struct audio_block blk;
+
+	while (!s_ctx.cancel) {
+		if (!streams_remaining()) {
+			drained = true;
+			break;
+		}
+
+		ret = k_mem_slab_alloc(&mem_slab, &blk.data, K_MSEC(TIMEOUT));
+		if (ret < 0) {
+			LOG_ERR("Failed to allocate audio TX block: %d", ret);
 			break;
 		}
-		block_idx = (block_idx + 1) % BLOCK_COUNT;
-	} while(1);
+		atomic_set(&s_ctx.reader_holding, 1);
+
+		len = mix_block(blk.data);
+		if (len == 0 || s_ctx.cancel) {
+			atomic_set(&s_ctx.reader_holding, 0);
+			free_block(&blk);
+			continue;
+		}
+		blk.len = len;
+		k_msgq_put(&block_queue, &blk, K_FOREVER);
+		atomic_set(&s_ctx.reader_holding, 0);
+	}
+
+	/* Tell the writer we're done and wait for it to play out */
+	blk.data = NULL;
+	k_msgq_put(&block_queue, &blk, K_FOREVER);
+	k_thread_join(s_ctx.writer_tid, K_FOREVER);
+	pm_device_runtime_put(s_ctx.i2s_dev);
+
+	if (!drained) {
+		/* Cancelled or failed, drop whatever is still playing */
+		k_mutex_lock(&s_ctx.lock, K_FOREVER);
+		for (int i = 0; i < AUDIO_MAX_STREAMS; ++i) {
+			if (s_ctx.streams[i].state == STREAM_ACTIVE) {
+				stream_release(&s_ctx.streams[i]);
+				s_ctx.streams[i].state = STREAM_FREE;
+			}
+		}
+		s_ctx.running = false;
+		k_mutex_unlock(&s_ctx.lock);
+	}
+}
+
+static bool wav_supported(const struct wav_header *wavh)
+{
+	if (wavh->audio_format != 1 || wavh->nbr_channels != 1 || wavh->frequency != 44100 ||
+		wavh->bits_per_sample != 16) {
+		LOG_ERR("WAV file format incorrect, must be mono PCM, 16 bits per sample, 44100");
+		return false;
+	}
+	return true;
+}
+
+/* Byte offset of the whole sample offset_ms into the data chunk */
+static uint32_t wav_offset(const struct wav_header *wavh, uint32_t offset_ms)
+{
+	uint64_t offset = (uint64_t)offset_ms * SAMPLE_FREQUENCY / 1000 * BYTES_PER_SAMPLE;
+	return MIN(offset, wavh->data_size & ~(BYTES_PER_SAMPLE - 1));
+}
+
+/* Open a wav file and leave it positioned offset_ms into the samples */
+static int open_wav(struct fs_file_t *file, const char *filename, uint32_t offset_ms)
+{
+	int err = fs_open(file, filename, FS_O_READ);
+	if (err != 0) {
+		LOG_ERR("Failed to open %s for reading", filename);
+		return err;
+	}
+
+	struct wav_header wavh;
+	ssize_t len = fs_read(file, &wavh, sizeof(wavh));
+	if (len < (ssize_t)sizeof(wavh)) {
+		LOG_ERR("Only read %d bytes from audio file %s", len, filename);
+		fs_close(file);
+		return len < 0 ? len : -EINVAL;
+	}
+
+	/*
+	LOG_INF("Wav file data:");
+	LOG_INF("\tfile_type_block_id=0x%08x", wavh.file_type_bloc_id);
+	LOG_INF("\tfile_size=%d", wavh.file_size);
+	LOG_INF("\tfile_format_id=0x%08x", wavh.file_format_id);
+	LOG_INF("\tformat_bloc_id=0x%08x", wavh.format_bloc_id);
+	LOG_INF("\tformat_bloc_size=%d", wavh.format_bloc_size);
+	LOG_INF("\taudio_format=%d", wavh.audio_format);
+	LOG_INF("\tnbr_channels=%d", wavh.nbr_channels);
+	LOG_INF("\tfrequency=%d", wavh.frequency);
+	LOG_INF("\tbytes_per_sec=%d", wavh.bytes_per_sec);
+	LOG_INF("\tbytes_per_bloc=%d", wavh.bytes_per_bloc);
+	LOG_INF("\tbits_per_sample=%d", wavh.bits_per_sample);
+	LOG_INF("\tdata_block_id=0x%08x", wavh.data_block_id);
+	LOG_INF("\tdata_size=%d", wavh.data_size);
+	*/
+
+	if (!wav_supported(&wavh)) {
+		fs_close(file);
+		return -EINVAL;
+	}
+
+	if (offset_ms > 0) {
+		/* Seek to a whole sample, the data chunk follows the header */
+		err = fs_seek(file, wav_offset(&wavh, offset_ms), FS_SEEK_CUR);
+		if (err != 0) {
+			LOG_ERR("Failed to seek %s to %u ms: %d", filename, offset_ms, err);
+			fs_close(file);
+			return err;
+		}
+	}
+	return 0;
+}
+
+/* Wake the SD card if the file is on it, then open the file */
+static int stream_open(struct audio_stream *stream, const char *filename, uint32_t offset_ms)
+{
+	stream->src.type = SOURCE_FILE;
+	stream->disk_ref = power_disk_get(filename);
+	int err = open_wav(&stream->src.file, filename, offset_ms);
+	if (err != 0 && stream->disk_ref) {
+		power_disk_put();
+		stream->disk_ref = false;
+	}
+	return err;
+}
+
+/* Point a stream at a wav in the song pack, offset_ms into the samples */
+static int stream_open_packed(struct audio_stream *stream, uint32_t offset, uint32_t size,
+		uint32_t offset_ms)
+{
+	struct wav_header wavh;
+
+	stream->disk_ref = power_disk_get(PACK_PATH);
+	ssize_t len = pack_read(offset, &wavh, MIN(size, sizeof(wavh)));
+	if (len < (ssize_t)sizeof(wavh) || !wav_supported(&wavh)) {
+		LOG_ERR("Bad wav at %u in %s", offset, PACK_PATH);
+		if (stream->disk_ref) {
+			power_disk_put();
+			stream->disk_ref = false;
+		}
+		return len < 0 ? len : -EINVAL;
+	}
+
+	uint32_t data_size = MIN(wavh.data_size, size - sizeof(wavh));
+	uint32_t skip = wav_offset(&wavh, offset_ms);
+	stream->src.type = SOURCE_PACK;
+	stream->src.pack_pos = offset + sizeof(wavh) + skip;
+	stream->src.remaining = data_size - MIN(skip, data_size);
+	return 0;
+}
+
+/* Point a stream at a clip in flash, offset_ms into the samples */
+static int stream_open_clip(struct audio_stream *stream, const struct audio_clip *clip,
+		uint32_t offset_ms)
+{
+	uint32_t first = MIN((uint64_t)offset_ms * SAMPLE_FREQUENCY / 1000, clip->samples);
+
+	stream->disk_ref = false;
+	stream->src.remaining = (clip->samples - first) * BYTES_PER_SAMPLE;
+	if (clip->adpcm) {
+#if defined(CONFIG_APP_DEFAULT_SONG_ADPCM)
+		stream->src.type = SOURCE_ADPCM;
+		adpcm_start(&stream->src.adpcm, clip->data, first);
+		return 0;
+#else
+		LOG_ERR("ADPCM support isn't built in");
+		return -ENOTSUP;
+#endif
+	}
+	stream->src.type = SOURCE_MEMORY;
+	stream->src.data = clip->data + first * BYTES_PER_SAMPLE;
+	return 0;
+}
+
+/* Bring the I2S out of its low power state ahead of a new stream.  Called
+ * with i2s_pm_lock held.
+ */
+static void i2s_resume(void)
+{
+	uint32_t start = k_cycle_get_32();
+	int err = pm_device_runtime_get(s_ctx.i2s_dev);
+	uint32_t latency = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+	if (err < 0) {
+		LOG_ERR("Failed to resume %s: %d", s_ctx.i2s_dev->name, err);
+	}
+	s_ctx.stats.i2s_resume_last_us = latency;
+	s_ctx.stats.i2s_resume_max_us = MAX(s_ctx.stats.i2s_resume_max_us, latency);
+	if (latency > CONFIG_APP_RESUME_LATENCY_MAX_MS * USEC_PER_MSEC &&
+		!s_ctx.stats.i2s_suspend_disabled) {
+		LOG_WRN("I2S took %u us to resume, leaving it powered", latency);
+		/* A reference that is never dropped keeps it up from now on */
+		pm_device_runtime_get(s_ctx.i2s_dev);
+		s_ctx.stats.i2s_suspend_disabled = true;
+	}
+}
+
+/* Take the reference for a new stream, or the one audio_prepare() took */
+static void i2s_take(void)
+{
+	k_mutex_lock(&i2s_pm_lock, K_FOREVER);
+	if (s_ctx.prepared) {
+		s_ctx.prepared = false;
+		k_work_cancel_delayable(&i2s_unprepare);
+	} else {
+		i2s_resume();
+	}
+	k_mutex_unlock(&i2s_pm_lock);
+}
+
+static void unprepare_handler(struct k_work *work)
+{
+	k_mutex_lock(&i2s_pm_lock, K_FOREVER);
+	if (s_ctx.prepared) {
+		/* No play came */
+		s_ctx.prepared = false;
+		pm_device_runtime_put(s_ctx.i2s_dev);
+	}
+	k_mutex_unlock(&i2s_pm_lock);
+}
+
+void audio_prepare(void)
+{
+	k_mutex_lock(&i2s_pm_lock, K_FOREVER);
+	if (s_ctx.pm_ready && !s_ctx.prepared) {
+		i2s_resume();
+		s_ctx.prepared = true;
+	}
+	if (s_ctx.prepared) {
+		k_work_reschedule(&i2s_unprepare, PREPARE_HOLD);
+	}
+	k_mutex_unlock(&i2s_pm_lock);
+}
+
+/* Hand a stream that has been opened over to the audio thread, starting
+ * the thread if it isn't already running.
+ */
+static void stream_activate(struct audio_stream *stream)
+{
+	bool start;
 
-done:
-	i2s_trigger(s_ctx.i2s_dev, I2S_DIR_TX, I2S_TRIGGER_DROP);
-	fs_close(&s_ctx.file);
+	k_mutex_lock(&s_ctx.lock, K_FOREVER);
+	stream->state = STREAM_ACTIVE;
+	start = !s_ctx.running;
+	s_ctx.running = true;
+	k_mutex_unlock(&s_ctx.lock);
+
+	if (!start) {
+		return;
+	}
+	if (s_ctx.tid != NULL) {
+		/* The previous thread has cleared running and is on its way out */
+		k_thread_join(s_ctx.tid, K_FOREVER);
+	}
+	s_ctx.cancel = false;
+	s_ctx.start_timestamp = -1;
+	i2s_take();
+	s_ctx.writer_tid = k_thread_create(&writer_thread_data, writer_stack_area,
+			K_THREAD_STACK_SIZEOF(writer_stack_area),
+			handle_writer, NULL, NULL, NULL,
+			CONFIG_APP_AUDIO_WRITER_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(s_ctx.writer_tid, "audio_writer");
+	s_ctx.tid = k_thread_create(&audio_thread_data, audio_stack_area,
+			K_THREAD_STACK_SIZEOF(audio_stack_area),
+			handle_playback, NULL, NULL, NULL,
+			CONFIG_APP_AUDIO_READER_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(s_ctx.tid, "audio_reader");
 }
 
 int audio_init(void)
 {
 	s_ctx.i2s_dev = DEVICE_DT_GET(I2S_NODE);
 	s_ctx.tid = NULL;
+	s_ctx.writer_tid = NULL;
 	s_ctx.cancel = false;
-	fs_file_t_init(&s_ctx.file);
+	s_ctx.running = false;
+	k_mutex_init(&s_ctx.lock);
+	for (int i = 0; i < AUDIO_MAX_STREAMS; ++i) {
+		s_ctx.streams[i].state = STREAM_FREE;
+		s_ctx.streams[i].disk_ref = false;
+		s_ctx.streams[i].src.type = SOURCE_FILE;
+		fs_file_t_init(&s_ctx.streams[i].src.file);
+	}
 
 	if (!device_is_ready(s_ctx.i2s_dev)) {
 		LOG_ERR("%s is not ready", s_ctx.i2s_dev->name);
@@ -129,16 +723,18 @@ int audio_init(void)
 		LOG_ERR("Failed to configure audio stream: %d", ret);
 	}
 
-	/* Allocate the mem_slab blocks */
-	for (int i = 0; i < BLOCK_COUNT; ++i) {
-		ret = k_mem_slab_alloc(&mem_slab, &s_ctx.mem_block[i], K_NO_WAIT);
-		if (ret < 0) {
-			LOG_ERR("Failed to allocate audio TX block %d: %d", i, ret);
-			return ret;
-		}
-	}
-
 	s_ctx.start_timestamp = -1;
+	s_ctx.start_offset_ms = 0;
+	audio_reset_stats();
+
+	/* Let the I2S sleep between tracks, i2s_resume() wakes it up */
+	int err = pm_device_runtime_enable(s_ctx.i2s_dev);
+	if (err < 0 && err != -ENOTSUP) {
+		LOG_ERR("Failed to enable runtime PM for %s: %d", s_ctx.i2s_dev->name, err);
+	}
+	k_mutex_lock(&i2s_pm_lock, K_FOREVER);
+	s_ctx.pm_ready = true;
+	k_mutex_unlock(&i2s_pm_lock);
 
 	return ret;
 }
@@ -153,68 +749,137 @@ void audio_cancel(void)
 
 bool audio_busy(void)
 {
-	if (s_ctx.tid != NULL && k_thread_join(s_ctx.tid, K_NO_WAIT) != 0) {
-		return true;
-	}
-	return false;
+	return s_ctx.streams[SONG_STREAM].state != STREAM_FREE;
 }
 
-int audio_play(const char *filename)
+bool audio_started(void)
 {
+	return s_ctx.start_timestamp != -1;
+}
+
+/* Get the song stream ready for a new song */
+static struct audio_stream *song_stream(void)
+{
+	struct audio_stream *song = &s_ctx.streams[SONG_STREAM];
+
 	/* Make sure we're not currently playing */
-	if (audio_busy()) {
-		LOG_ERR("audio_play called while audio thread is running");
+	if (song->state != STREAM_FREE) {
+		LOG_ERR("audio_play called while a song is playing");
+		return NULL;
+	}
+
+	/* A song starts its own stream so the motors line up with it; any
+	 * effects still going on their own get cut short.
+	 */
+	audio_cancel();
+	return song;
+}
+
+static void song_activate(struct audio_stream *song, uint32_t offset_ms)
+{
+	s_ctx.start_offset_ms = offset_ms;
+	song->gain = AUDIO_GAIN_UNITY;
+	stream_activate(song);
+}
+
+int audio_play(const char *filename, uint32_t offset_ms)
+{
+	struct audio_stream *song = song_stream();
+	if (song == NULL) {
 		return -EBUSY;
 	}
 
-	int err = fs_open(&s_ctx.file, filename, FS_O_READ);
+	int err = stream_open(song, filename, offset_ms);
 	if (err != 0) {
-		LOG_ERR("Failed to open %s for reading", filename);
 		return err;
 	}
 
-	struct wav_header wavh;
-	size_t len = fs_read(&s_ctx.file, &wavh, sizeof(wavh));
-	if (len < sizeof(wavh)) {
-		LOG_ERR("Only read %d bytes from audio file %s", len, filename);
-		return len;
+	song_activate(song, offset_ms);
+	return 0;
+}
+
+int audio_play_packed(uint32_t offset, uint32_t size, uint32_t offset_ms)
+{
+	struct audio_stream *song = song_stream();
+	if (song == NULL) {
+		return -EBUSY;
 	}
 
-	/*
-	LOG_INF("Wav file data:");
-	LOG_INF("\tfile_type_block_id=0x%08x", wavh.file_type_bloc_id);
-	LOG_INF("\tfile_size=%d", wavh.file_size);
-	LOG_INF("\tfile_format_id=0x%08x", wavh.file_format_id);
-	LOG_INF("\tformat_bloc_id=0x%08x", wavh.format_bloc_id);
-	LOG_INF("\tformat_bloc_size=%d", wavh.format_bloc_size);
-	LOG_INF("\taudio_format=%d", wavh.audio_format);
-	LOG_INF("\tnbr_channels=%d", wavh.nbr_channels);
-	LOG_INF("\tfrequency=%d", wavh.frequency);
-	LOG_INF("\tbytes_per_sec=%d", wavh.bytes_per_sec);
-	LOG_INF("\tbytes_per_bloc=%d", wavh.bytes_per_bloc);
-	LOG_INF("\tbits_per_sample=%d", wavh.bits_per_sample);
-	LOG_INF("\tdata_block_id=0x%08x", wavh.data_block_id);
-	LOG_INF("\tdata_size=%d", wavh.data_size);
-	*/
+	int err = stream_open_packed(song, offset, size, offset_ms);
+	if (err != 0) {
+		return err;
+	}
 
-	if (wavh.audio_format != 1 || wavh.nbr_channels != 1 || wavh.frequency != 44100 || wavh.bits_per_sample != 16) {
-		LOG_ERR("WAV file format incorrect, must be mono PCM, 16 bits per sample, 44100");
-		fs_close(&s_ctx.file);
-		return -EINVAL;
+	song_activate(song, offset_ms);
+	return 0;
+}
+
+int audio_play_clip(const struct audio_clip *clip, uint32_t offset_ms)
+{
+	struct audio_stream *song = song_stream();
+	if (song == NULL) {
+		return -EBUSY;
 	}
 
-	s_ctx.cancel = false;
-	s_ctx.tid = k_thread_create(&audio_thread_data, audio_stack_area,
-			K_THREAD_STACK_SIZEOF(audio_stack_area),
-			handle_playback, NULL, NULL, NULL, 5, 0, K_NO_WAIT);
+	int err = stream_open_clip(song, clip, offset_ms);
+	if (err != 0) {
+		return err;
+	}
 
+	song_activate(song, offset_ms);
 	return 0;
 }
 
-uint32_t audio_playtime(void)
+int audio_play_effect(const char *filename, int16_t gain)
+{
+	struct audio_stream *stream = NULL;
+
+	k_mutex_lock(&s_ctx.lock, K_FOREVER);
+	for (int i = SONG_STREAM + 1; i < AUDIO_MAX_STREAMS; ++i) {
+		if (s_ctx.streams[i].state == STREAM_FREE) {
+			stream = &s_ctx.streams[i];
+			stream->state = STREAM_OPENING;
+			break;
+		}
+	}
+	k_mutex_unlock(&s_ctx.lock);
+
+	if (stream == NULL) {
+		LOG_ERR("No free stream for effect %s", filename);
+		return -EBUSY;
+	}
+
+	int err = stream_open(stream, filename, 0);
+	if (err != 0) {
+		k_mutex_lock(&s_ctx.lock, K_FOREVER);
+		stream->state = STREAM_FREE;
+		k_mutex_unlock(&s_ctx.lock);
+		return err;
+	}
+
+	stream->gain = gain;
+	stream_activate(stream);
+
+	return 0;
+}
+
+int32_t audio_playtime(void)
 {
 	if (s_ctx.start_timestamp == -1) {
-		return 0;
+		return s_ctx.start_offset_ms;
 	}
-	return k_uptime_get() - s_ctx.start_timestamp;
+	return k_uptime_get() - s_ctx.start_timestamp + s_ctx.start_offset_ms;
+}
+
+void audio_get_stats(struct audio_stats *stats)
+{
+	*stats = s_ctx.stats;
+}
+
+void audio_reset_stats(void)
+{
+	s_ctx.stats.near_underruns = 0;
+	s_ctx.stats.underruns = 0;
+	s_ctx.stats.min_queued = BLOCK_COUNT;
+	s_ctx.stats.i2s_resume_max_us = 0;
 }
@@ -44,14 +44,62 @@ struct wav_header {
 	uint32_t data_size;
 } __attribute__((packed));
 
+/* Bytes in each block given to the I2S, 100 ms of 16 bit mono at 44.1 kHz */
+#define AUDIO_BLOCK_SIZE (44100 / 10 * 2)
+
+/* Streams that can be mixed at once: the song plus one-shot effects */
+#define AUDIO_MAX_STREAMS 4
+
+/* Stream gains are Q15 */
+#define AUDIO_GAIN_UNITY INT16_MAX
+
+/* Samples linked into the firmware, see src/clip.c */
+struct audio_clip {
+	const uint8_t *data;
+	uint32_t samples;
+	/* IMA ADPCM blocks (see adpcm.h) rather than 16 bit PCM */
+	bool adpcm;
+};
+
+struct audio_stats {
+	/* Times the I2S queue dropped to CONFIG_APP_UNDERRUN_THRESHOLD blocks */
+	uint32_t near_underruns;
+	/* Times the I2S actually ran dry and had to be restarted */
+	uint32_t underruns;
+	/* Lowest number of blocks queued to the I2S while playing */
+	int32_t min_queued;
+	/* How long the I2S took to come out of its low power state */
+	uint32_t i2s_resume_last_us;
+	uint32_t i2s_resume_max_us;
+	/* Set once a resume went over CONFIG_APP_RESUME_LATENCY_MAX_MS */
+	bool i2s_suspend_disabled;
+};
+
 int audio_init(void);
 
-int audio_play(const char *filename);
+int audio_play(const char *filename, uint32_t offset_ms);
+
+/* Play the wav stored size bytes at offset in the song pack */
+int audio_play_packed(uint32_t offset, uint32_t size, uint32_t offset_ms);
+
+int audio_play_clip(const struct audio_clip *clip, uint32_t offset_ms);
+
+int audio_play_effect(const char *filename, int16_t gain);
+
+/* Start waking the I2S for a play that's on its way */
+void audio_prepare(void);
 
 void audio_cancel(void);
 
 bool audio_busy(void);
 
-uint32_t audio_playtime(void);
+bool audio_started(void);
+
+/* Milliseconds into the track, signed to compare with instruction times */
+int32_t audio_playtime(void);
+
+void audio_get_stats(struct audio_stats *stats);
+
+void audio_reset_stats(void);
 
 #endif
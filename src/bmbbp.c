@@ -1,12 +1,18 @@
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <zephyr/fs/fs.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
 #include "bmbbp.h"
 #include "audio.h"
+#include "cache.h"
+#include "choreo.h"
 #include "motor.h"
+#include "pack.h"
 
 /* Source code for the Big Mouth Billy Bass Protocol (bmbbp) */
 
@@ -15,34 +21,426 @@ static sys_slist_t s_song_audios = SYS_SLIST_STATIC_INIT(&s_song_audios);
 static sys_slist_t s_joke_audios = SYS_SLIST_STATIC_INIT(&s_joke_audios);
 static bmbbp_mode_t s_mode = SONGS;
 static struct bmbbp_audio *s_current_audio = NULL;
+/* Song last started, it can still be playing after `bmbb next` or a mode
+ * change has moved s_current_audio on
+ */
+static struct bmbbp_audio *s_playing_audio = NULL;
+/* main adds songs while the button and the shell walk the lists.  Songs are
+ * never taken off a list, so names handed out stay valid after unlocking.
+ */
+K_MUTEX_DEFINE(audio_list_lock);
 
 LOG_MODULE_DECLARE(bmbb);
 
-static int add_instructions(const char *datfilename, sys_slist_t *instructions)
+/* Size of the chunks read from a .dat file.  The parser is a small state
+ * machine so lines may straddle chunk boundaries.
+ */
+#define DAT_READ_CHUNK 1024
+/* Timestamps are in milliseconds; 9 digits is already ~11 days. */
+#define DAT_MAX_DIGITS 9
+/* Subtracting a 200ms fudge factor because that seems to match up better. */
+#define DAT_FUDGE_MS 200
+/* Longest path for a fish's .dat file */
+#define DAT_NAME_MAX 80
+
+/* Shared by every parse, dat_buf_lock lets one script through at a time */
+static char s_dat_buf[DAT_READ_CHUNK];
+K_MUTEX_DEFINE(dat_buf_lock);
+
+enum dat_state {
+	DAT_LINE_START,
+	DAT_TIMESTAMP,
+	DAT_TRAILING,
+	DAT_COMMENT,
+};
+
+struct dat_parser {
+	const char *name;
+	struct movement_track *track;
+	size_t capacity;
+	enum dat_state state;
+	uint32_t line;
+	bmbbp_movement_t type;
+	uint32_t value;
+	uint8_t digits;
+};
+
+static void free_track(struct movement_track *track)
+{
+	k_free(track->instructions);
+	track->instructions = NULL;
+	track->count = 0;
+}
+
+/* Grow the track's array by doubling, so loading is amortized O(n) */
+static int track_reserve(struct dat_parser *p)
+{
+	if (p->track->count < p->capacity) {
+		return 0;
+	}
+
+	size_t capacity = p->capacity == 0 ? 64 : p->capacity * 2;
+	struct movement_instruction *grown = k_malloc(capacity * sizeof(*grown));
+	if (grown == NULL) {
+		return -ENOMEM;
+	}
+	if (p->track->count > 0) {
+		memcpy(grown, p->track->instructions, p->track->count * sizeof(*grown));
+	}
+	k_free(p->track->instructions);
+	p->track->instructions = grown;
+	p->capacity = capacity;
+	return 0;
+}
+
+static int dat_emit(struct dat_parser *p)
+{
+	if (p->digits == 0) {
+		LOG_ERR("%s:%u: missing timestamp", p->name, p->line);
+		return -EINVAL;
+	}
+
+	if (track_reserve(p) != 0) {
+		LOG_ERR("%s:%u: out of memory", p->name, p->line);
+		return -ENOMEM;
+	}
+	struct movement_instruction *new = &p->track->instructions[p->track->count++];
+	new->type = p->type;
+	new->timestamp = (int32_t)p->value - DAT_FUDGE_MS;
+	return 0;
+}
+
+static int dat_movement(char c, bmbbp_movement_t *type)
+{
+	switch (c) {
+	case 'H':
+		*type = HEAD;
+		return 0;
+	case 'M':
+		*type = MOUTH;
+		return 0;
+	case 'T':
+		*type = TAIL;
+		return 0;
+	case 'R':
+		*type = RELEASE;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+/* Feed a chunk of .dat text to the parser.  Instructions are like 'M30500'
+ * to open the mouth 30.5 seconds into the song: one of H, M, T or R followed
+ * by a millisecond timestamp of any width.  Blank lines, surrounding
+ * whitespace, CRLF line endings and '#' comments are allowed.
+ */
+static int dat_parse_chunk(struct dat_parser *p, const char *buf, size_t len)
+{
+	const char *c = buf;
+	const char *end = buf + len;
+	int err;
+
+	while (c < end) {
+		switch (p->state) {
+		case DAT_LINE_START:
+			switch (*c) {
+			case ' ':
+			case '\t':
+			case '\r':
+				break;
+			case '\n':
+				p->line++;
+				break;
+			case '#':
+				p->state = DAT_COMMENT;
+				break;
+			default:
+				if (dat_movement(*c, &p->type) != 0) {
+					LOG_ERR("%s:%u: unknown instruction '%c'", p->name, p->line, *c);
+					return -EINVAL;
+				}
+				p->value = 0;
+				p->digits = 0;
+				p->state = DAT_TIMESTAMP;
+				break;
+			}
+			c++;
+			break;
+		case DAT_TIMESTAMP:
+			while (c < end && *c >= '0' && *c <= '9') {
+				if (p->digits == DAT_MAX_DIGITS) {
+					LOG_ERR("%s:%u: timestamp too long", p->name, p->line);
+					return -EINVAL;
+				}
+				p->value = p->value * 10 + (*c - '0');
+				p->digits++;
+				c++;
+			}
+			if (c < end) {
+				/* Anything but a digit ends the timestamp */
+				err = dat_emit(p);
+				if (err != 0) {
+					return err;
+				}
+				p->state = DAT_TRAILING;
+			}
+			break;
+		case DAT_TRAILING:
+			switch (*c) {
+			case ' ':
+			case '\t':
+			case '\r':
+				break;
+			case '\n':
+				p->line++;
+				p->state = DAT_LINE_START;
+				break;
+			case '#':
+				p->state = DAT_COMMENT;
+				break;
+			default:
+				LOG_ERR("%s:%u: unexpected '%c' after timestamp", p->name, p->line, *c);
+				return -EINVAL;
+			}
+			c++;
+			break;
+		case DAT_COMMENT:
+			c = memchr(c, '\n', end - c);
+			if (c == NULL) {
+				return 0;
+			}
+			p->line++;
+			p->state = DAT_LINE_START;
+			c++;
+			break;
+		}
+	}
+	return 0;
+}
+
+/* Flush a final instruction that had no trailing newline */
+static int dat_parse_finish(struct dat_parser *p)
+{
+	if (p->state == DAT_TIMESTAMP) {
+		return dat_emit(p);
+	}
+	return 0;
+}
+
+/* Scripts are almost always written in order, so an insertion sort is
+ * linear in practice and keeps equal timestamps in file order.
+ *
+ * @return Number of instructions that were out of order.
+ */
+static uint32_t sort_track(struct movement_track *track)
+{
+	struct movement_instruction *inst = track->instructions;
+	uint32_t reordered = 0;
+
+	for (size_t i = 1; i < track->count; ++i) {
+		struct movement_instruction key = inst[i];
+		size_t j = i;
+		while (j > 0 && inst[j - 1].timestamp > key.timestamp) {
+			inst[j] = inst[j - 1];
+			j--;
+		}
+		if (j != i) {
+			reordered++;
+		}
+		inst[j] = key;
+	}
+	return reordered;
+}
+
+/* Index of the first instruction at or after offset_ms */
+static size_t find_instruction(const struct movement_track *track, int32_t offset_ms)
+{
+	size_t lo = 0;
+	size_t hi = track->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (track->instructions[mid].timestamp < offset_ms) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Where a script is read from: a file of its own, a piece of the song pack
+ * or memory.
+ */
+struct dat_source {
+	struct fs_file_t *file;
+	const char *data;
+	uint32_t offset;
+	uint32_t remaining;
+};
+
+/* Point chunk at the next piece of the script and return its length */
+static ssize_t dat_read(struct dat_source *src, const char **chunk)
+{
+	ssize_t ret;
+
+	if (src->data != NULL) {
+		/* Already in memory, parse it where it is */
+		*chunk = src->data;
+		ret = src->remaining;
+		src->remaining = 0;
+		return ret;
+	}
+
+	*chunk = s_dat_buf;
+	if (src->file != NULL) {
+		return fs_read(src->file, s_dat_buf, sizeof(s_dat_buf));
+	}
+
+	ret = pack_read(src->offset, s_dat_buf, MIN(sizeof(s_dat_buf), src->remaining));
+	if (ret > 0) {
+		src->offset += ret;
+		src->remaining -= ret;
+	}
+	return ret;
+}
+
+/* Read a whole script into track, in file order */
+static int parse_dat(const char *datfilename, struct dat_source *src,
+		struct movement_track *track)
+{
+	struct dat_parser parser = {
+		.name = datfilename,
+		.track = track,
+		.state = DAT_LINE_START,
+		.line = 1,
+	};
+	const char *chunk;
+	ssize_t len;
+	int err;
+
+	k_mutex_lock(&dat_buf_lock, K_FOREVER);
+	while (true) {
+		len = dat_read(src, &chunk);
+		if (len < 0) {
+			LOG_ERR("Failed to read from %s: %d", datfilename, len);
+			err = len;
+			break;
+		} else if (len == 0) {
+			err = dat_parse_finish(&parser);
+			break;
+		}
+		err = dat_parse_chunk(&parser, chunk, len);
+		if (err != 0) {
+			break;
+		}
+	}
+	k_mutex_unlock(&dat_buf_lock);
+
+	if (err != 0) {
+		free_track(track);
+	}
+	return err;
+}
+
+static int parse_track(const char *datfilename, struct dat_source *src,
+		struct movement_track *track)
+{
+	int err = parse_dat(datfilename, src, track);
+	if (err != 0) {
+		return err;
+	}
+
+	uint32_t reordered = sort_track(track);
+#if defined(CONFIG_APP_CHOREO_OPTIMIZE)
+	struct choreo_report report = {
+		.reordered = reordered,
+	};
+	size_t loaded = track->count;
+
+	err = choreo_optimize(track, &report);
+	if (err != 0) {
+		LOG_ERR("Failed to optimize %s: %d", datfilename, err);
+		free_track(track);
+		return err;
+	}
+	if (track->count != loaded || report.reordered > 0) {
+		LOG_INF("%s: %d -> %d instructions (%u reordered, dropped %u mouth, %u mouth over "
+			"duty, %u tail, %u head, %u release, added %u release)", datfilename, loaded,
+			track->count, report.reordered, report.mouth_dropped, report.mouth_limited,
+			report.tail_dropped, report.head_dropped, report.release_dropped,
+			report.release_added);
+	}
+#else
+	if (reordered > 0) {
+		LOG_INF("%s: %u instructions out of order", datfilename, reordered);
+	}
+#endif
+	return 0;
+}
+
+static int add_instructions(const char *datfilename, struct movement_track *track)
 {
 	struct fs_file_t datfile;
 	fs_file_t_init(&datfile);
 
-	int err = fs_open(&datfile, datfilename, FS_O_READ);
+	char cached[CACHE_PATH_MAX];
+	int err = fs_open(&datfile, cache_resolve(datfilename, cached, sizeof(cached)), FS_O_READ);
 	if (err != 0) {
 		LOG_ERR("Failed to open %s for reading", datfilename);
 		return err;
 	}
 
-	/* Read instructions from .dat file.  Instructions are like 'M030500'
-	* to open the mouth 30.5 seconds into the song.  To keep it simple:
-	* 1. All timestamps must be 6 characters, 0 padded
-	* 2. Must end in \n, windows not supported
-	*/
+	struct dat_source src = {
+		.file = &datfile,
+		.data = NULL,
+	};
+	err = parse_track(datfilename, &src, track);
+	fs_close(&datfile);
+	return err;
+}
+
+static int add_packed_instructions(const char *name, const struct pack_extent *dat,
+		struct movement_track *track)
+{
+	struct dat_source src = {
+		.file = NULL,
+		.data = NULL,
+		.offset = dat->offset,
+		.remaining = dat->size,
+	};
+	return parse_track(name, &src, track);
+}
+
+/* What the old reader allocated for each line */
+struct per_line_instruction {
+	sys_snode_t node;
+	bmbbp_movement_t type;
+	int32_t timestamp;
+};
+
+/* The reader the streaming parser replaced, kept as it was apart from its
+ * error checks so bmbb datbench times the real thing: one fs_read(),
+ * strtoul() and k_malloc() per 8 byte line, appended to a list.
+ */
+static int parse_per_line(struct fs_file_t *datfile, sys_slist_t *instructions)
+{
 	char line[8];
 	ssize_t len;
+
 	while (true) {
-		len = fs_read(&datfile, line, sizeof(line));
-		if (len < sizeof(line) || line[7] != '\n') {
+		len = fs_read(datfile, line, sizeof(line));
+		if (len < 0) {
+			return len;
+		}
+		if ((size_t)len < sizeof(line) || line[7] != '\n') {
 			/* Probably EOF */
 			break;
 		}
-		struct movement_instruction *new = k_malloc(sizeof(struct movement_instruction));
+		struct per_line_instruction *new = k_malloc(sizeof(struct per_line_instruction));
+		if (new == NULL) {
+			return -ENOMEM;
+		}
 		switch (line[0]) {
 		case 'H':
 			new->type = HEAD;
@@ -57,14 +455,64 @@ static int add_instructions(const char *datfilename, sys_slist_t *instructions)
 			new->type = RELEASE;
 			break;
 		}
-		/* Subtracting a 200ms fudge factor because that seems to match up better. */
-		new->timestamp = strtoul(&line[1], NULL, 10) - 200;
+		new->timestamp = strtoul(&line[1], NULL, 10) - DAT_FUDGE_MS;
 		sys_slist_append(instructions, &new->node);
 	}
-	fs_close(&datfile);
 	return 0;
 }
 
+static void free_per_line(sys_slist_t *instructions)
+{
+	sys_snode_t *node;
+
+	while ((node = sys_slist_get(instructions)) != NULL) {
+		k_free(CONTAINER_OF(node, struct per_line_instruction, node));
+	}
+}
+
+int bmbbp_bench_parse(const char *datfilename, struct bmbbp_parse_bench *bench)
+{
+	struct fs_file_t datfile;
+	struct movement_track track = { 0 };
+	uint32_t start;
+
+	fs_file_t_init(&datfile);
+	int err = fs_open(&datfile, datfilename, FS_O_READ);
+	if (err != 0) {
+		return err;
+	}
+	sys_slist_t instructions;
+	sys_slist_init(&instructions);
+	start = k_cycle_get_32();
+	err = parse_per_line(&datfile, &instructions);
+	bench->per_line_us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+	fs_close(&datfile);
+	bench->lines = sys_slist_len(&instructions);
+	free_per_line(&instructions);
+	if (err != 0) {
+		return err;
+	}
+
+	err = fs_open(&datfile, datfilename, FS_O_READ);
+	if (err != 0) {
+		return err;
+	}
+	struct dat_source src = {
+		.file = &datfile,
+		.data = NULL,
+	};
+	start = k_cycle_get_32();
+	err = parse_dat(datfilename, &src, &track);
+	bench->streaming_us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+	fs_close(&datfile);
+	if (err == 0 && track.count != bench->lines) {
+		/* Both readers have to agree for the timing to mean anything */
+		err = -EINVAL;
+	}
+	free_track(&track);
+	return err;
+}
+
 int bmbbp_init(void)
 {
 	audio_init();
@@ -73,15 +521,139 @@ int bmbbp_init(void)
 	return 0;
 }
 
-int bmbbp_add(bmbbp_mode_t mode, const char *wavfilename, const char *datfilename)
+/* Fish 0 plays SONG.DAT, the others play SONG.1.DAT, SONG.2.DAT, ... */
+static int fish_dat_name(char *buf, size_t len, const char *datfilename, size_t fish)
+{
+	const char *dot = strrchr(datfilename, '.');
+	if (dot == NULL) {
+		return -EINVAL;
+	}
+	int n = snprintf(buf, len, "%.*s.%u%s", (int)(dot - datfilename), datfilename,
+			(unsigned int)fish, dot);
+	return (n < 0 || (size_t)n >= len) ? -ENAMETOOLONG : 0;
+}
+
+static void free_tracks(struct movement_track *tracks)
+{
+	for (size_t i = 1; i < MOTOR_FISH_COUNT; ++i) {
+		if (tracks[i].instructions != tracks[0].instructions) {
+			free_track(&tracks[i]);
+		}
+	}
+	free_track(&tracks[0]);
+}
+
+/* Load every fish's track and merge them into one schedule */
+static int load_schedule(const char *datfilename, struct movement_track *schedule)
+{
+	struct movement_track tracks[MOTOR_FISH_COUNT] = { 0 };
+	char name[DAT_NAME_MAX];
+	struct fs_dirent entry;
+
+	int err = add_instructions(datfilename, &tracks[0]);
+	if (err != 0) {
+		return err;
+	}
+
+	for (size_t i = 1; i < MOTOR_FISH_COUNT; ++i) {
+		if (fish_dat_name(name, sizeof(name), datfilename, i) == 0 &&
+			fs_stat(name, &entry) == 0) {
+			err = add_instructions(name, &tracks[i]);
+			if (err != 0) {
+				goto done;
+			}
+		} else {
+			/* No track of its own, sing along with the first fish */
+			tracks[i] = tracks[0];
+		}
+	}
+
+	err = motor_build_schedule(tracks, MOTOR_FISH_COUNT, schedule);
+
+done:
+	free_tracks(tracks);
+	return err;
+}
+
+/* Same as load_schedule() but with the scripts out of the song pack */
+static int load_packed_schedule(const struct pack_entry *pack, struct movement_track *schedule)
+{
+	struct movement_track tracks[MOTOR_FISH_COUNT] = { 0 };
+
+	int err = add_packed_instructions(pack->name, &pack->dat[0], &tracks[0]);
+	if (err != 0) {
+		return err;
+	}
+
+	for (size_t i = 1; i < MOTOR_FISH_COUNT; ++i) {
+		if (i < MIN(pack->tracks, PACK_MAX_FISH) && pack->dat[i].size > 0) {
+			err = add_packed_instructions(pack->name, &pack->dat[i], &tracks[i]);
+			if (err != 0) {
+				goto done;
+			}
+		} else {
+			tracks[i] = tracks[0];
+		}
+	}
+
+	err = motor_build_schedule(tracks, MOTOR_FISH_COUNT, schedule);
+
+done:
+	free_tracks(tracks);
+	return err;
+}
+
+/* A built in song only has the one script, every fish follows it */
+static int load_clip_schedule(const char *name, const char *script, size_t len,
+		struct movement_track *schedule)
+{
+	struct movement_track tracks[MOTOR_FISH_COUNT] = { 0 };
+	struct dat_source src = {
+		.file = NULL,
+		.data = script,
+		.remaining = len,
+	};
+
+	int err = parse_track(name, &src, &tracks[0]);
+	if (err != 0) {
+		return err;
+	}
+	for (size_t i = 1; i < MOTOR_FISH_COUNT; ++i) {
+		tracks[i] = tracks[0];
+	}
+
+	err = motor_build_schedule(tracks, MOTOR_FISH_COUNT, schedule);
+	free_tracks(tracks);
+	return err;
+}
+
+static struct bmbbp_audio *new_audio(const char *wavfilename)
 {
-	sys_slist_t *audiolist = mode == SONGS ? &s_song_audios : &s_joke_audios;
 	struct bmbbp_audio *new = k_malloc(sizeof(struct bmbbp_audio));
+	if (new == NULL) {
+		LOG_ERR("Out of memory adding %s", wavfilename);
+		return NULL;
+	}
 	new->wav = wavfilename;
-	sys_slist_init(&new->instructions);
-	if (add_instructions(datfilename, &new->instructions) == 0) {
-		LOG_INF("Added %d instructions for song %s", sys_slist_len(&new->instructions), new->wav);
+	new->dat = NULL;
+	new->pack = NULL;
+	new->clip = NULL;
+	new->track.instructions = NULL;
+	new->track.count = 0;
+	new->resume_ms = 0;
+	return new;
+}
+
+/* Put a song on its list once its schedule has been loaded */
+static int add_audio(bmbbp_mode_t mode, struct bmbbp_audio *new, int err)
+{
+	sys_slist_t *audiolist = mode == SONGS ? &s_song_audios : &s_joke_audios;
+
+	if (err == 0) {
+		LOG_INF("Added %d instructions for song %s", new->track.count, new->wav);
+		k_mutex_lock(&audio_list_lock, K_FOREVER);
 		sys_slist_append(audiolist, &new->node);
+		k_mutex_unlock(&audio_list_lock);
 		return 0;
 	} else {
 		/* Failed to parse instructions, don't add this to the list */
@@ -90,13 +662,225 @@ int bmbbp_add(bmbbp_mode_t mode, const char *wavfilename, const char *datfilenam
 	}
 }
 
+int bmbbp_add(bmbbp_mode_t mode, const char *wavfilename, const char *datfilename)
+{
+	struct bmbbp_audio *new = new_audio(wavfilename);
+	if (new == NULL) {
+		return -ENOMEM;
+	}
+	new->dat = datfilename;
+	return add_audio(mode, new, load_schedule(datfilename, &new->track));
+}
+
+int bmbbp_add_packed(const struct pack_entry *entry)
+{
+	struct bmbbp_audio *new = new_audio(entry->name);
+	if (new == NULL) {
+		return -ENOMEM;
+	}
+	new->pack = entry;
+	return add_audio(entry->mode == JOKES ? JOKES : SONGS, new,
+		load_packed_schedule(entry, &new->track));
+}
+
+int bmbbp_add_clip(bmbbp_mode_t mode, const char *name, const struct audio_clip *clip,
+		const char *script, size_t script_len)
+{
+	struct bmbbp_audio *new = new_audio(name);
+	if (new == NULL) {
+		return -ENOMEM;
+	}
+	new->clip = clip;
+	return add_audio(mode, new, load_clip_schedule(name, script, script_len, &new->track));
+}
+
+int bmbbp_refresh(bmbbp_mode_t mode, const char *wavfilename, const char *datfilename)
+{
+	sys_slist_t *audiolist = mode == SONGS ? &s_song_audios : &s_joke_audios;
+	struct bmbbp_audio *audio;
+	bool found = false;
+
+	k_mutex_lock(&audio_list_lock, K_FOREVER);
+	SYS_SLIST_FOR_EACH_CONTAINER(audiolist, audio, node) {
+		/* The card doesn't care about case, so neither do uploads */
+		if (audio->dat != NULL && strcasecmp(audio->wav, wavfilename) == 0) {
+			found = true;
+			break;
+		}
+	}
+	k_mutex_unlock(&audio_list_lock);
+
+	if (found) {
+		/* Parse without holding up the button and the shell */
+		struct movement_track track = { 0 };
+		int err = load_schedule(audio->dat, &track);
+		if (err != 0) {
+			/* Keep playing the old moves */
+			return err;
+		}
+
+		k_mutex_lock(&audio_list_lock, K_FOREVER);
+		if (motor_running(&audio->track)) {
+			/* Stop the motors walking the old schedule before it's freed */
+			audio_cancel();
+			motor_cancel();
+		}
+		free_track(&audio->track);
+		audio->track = track;
+		audio->resume_ms = 0;
+		k_mutex_unlock(&audio_list_lock);
+		LOG_INF("Reloaded %d instructions for song %s", track.count, audio->wav);
+		return 0;
+	}
+
+	/* New song, the list holds on to the names */
+	char *wav = k_malloc(strlen(wavfilename) + 1);
+	char *dat = k_malloc(strlen(datfilename) + 1);
+	if (wav == NULL || dat == NULL) {
+		k_free(wav);
+		k_free(dat);
+		return -ENOMEM;
+	}
+	strcpy(wav, wavfilename);
+	strcpy(dat, datfilename);
+	int err = bmbbp_add(mode, wav, dat);
+	if (err != 0) {
+		k_free(wav);
+		k_free(dat);
+	}
+	return err;
+}
+
+/* Zephyr's fatfs renames over a file by deleting it first, so a power cut in
+ * between loses it.  The old file is moved aside to path.OLD instead and only
+ * deleted once the new one has its name, bmbbp_recover() undoes a cut
+ * anywhere in between.
+ */
+#define OLD_SUFFIX ".OLD"
+
+int bmbbp_rename_over(const char *from, const char *to)
+{
+	char old[DAT_NAME_MAX];
+	struct fs_dirent entry;
+	int err;
+
+	int n = snprintf(old, sizeof(old), "%s" OLD_SUFFIX, to);
+	if (n < 0 || (size_t)n >= sizeof(old)) {
+		return -ENAMETOOLONG;
+	}
+
+	bool exists = fs_stat(to, &entry) == 0;
+	if (exists) {
+		err = fs_rename(to, old);
+		if (err != 0) {
+			return err;
+		}
+	}
+	err = fs_rename(from, to);
+	if (err != 0) {
+		if (exists && fs_rename(old, to) != 0) {
+			LOG_ERR("Failed to put %s back", to);
+		}
+		return err;
+	}
+	if (exists) {
+		fs_unlink(old);
+	}
+	return 0;
+}
+
+int bmbbp_recover(const char *path)
+{
+	char old[DAT_NAME_MAX];
+	struct fs_dirent entry;
+	int err = 0;
+
+	int n = snprintf(old, sizeof(old), "%s" OLD_SUFFIX, path);
+	if (n < 0 || (size_t)n >= sizeof(old)) {
+		return -ENAMETOOLONG;
+	}
+	if (fs_stat(old, &entry) != 0) {
+		return 0;
+	}
+
+	if (fs_stat(path, &entry) == 0) {
+		/* The new file made it, only the cleanup didn't */
+		err = fs_unlink(old);
+	} else {
+		err = fs_rename(old, path);
+		if (err == 0) {
+			LOG_WRN("Put %s back after an interrupted replace", path);
+		}
+	}
+	if (err != 0) {
+		LOG_ERR("Failed to recover %s: %d", path, err);
+	}
+	return err;
+}
+
+void bmbbp_recover_dir(const char *dir)
+{
+	struct fs_dir_t dirp;
+	static struct fs_dirent entry;
+	char path[DAT_NAME_MAX];
+	size_t suffix = strlen(OLD_SUFFIX);
+
+	/* One at a time, the directory isn't changed while it's being read */
+	while (true) {
+		bool found = false;
+
+		fs_dir_t_init(&dirp);
+		if (fs_opendir(&dirp, dir) != 0) {
+			return;
+		}
+		while (fs_readdir(&dirp, &entry) == 0 && entry.name[0] != '\0') {
+			size_t len = strlen(entry.name);
+			if (entry.type != FS_DIR_ENTRY_DIR && len > suffix &&
+				strcasecmp(entry.name + len - suffix, OLD_SUFFIX) == 0) {
+				int n = snprintf(path, sizeof(path), "%s/%.*s", dir,
+					(int)(len - suffix), entry.name);
+				found = n > 0 && (size_t)n < sizeof(path);
+				if (found) {
+					break;
+				}
+			}
+		}
+		fs_closedir(&dirp);
+
+		if (!found || bmbbp_recover(path) != 0) {
+			return;
+		}
+	}
+}
+
+int bmbbp_replace(const char *tmp, const char *path)
+{
+	int err;
+
+	/* Held across the rename so the song can't start underneath it */
+	k_mutex_lock(&audio_list_lock, K_FOREVER);
+	if (audio_busy() && s_playing_audio != NULL &&
+		strcasecmp(s_playing_audio->wav, path) == 0) {
+		err = -EBUSY;
+	} else {
+		err = bmbbp_rename_over(tmp, path);
+	}
+	k_mutex_unlock(&audio_list_lock);
+	return err;
+}
+
 void bmbbp_toggle_mode(void) {
+	k_mutex_lock(&audio_list_lock, K_FOREVER);
 	s_mode = !s_mode;
 	s_current_audio = NULL;
+	k_mutex_unlock(&audio_list_lock);
 }
 
 const char *bmbbp_next_song(void)
 {
+	const char *wav = NULL;
+
+	k_mutex_lock(&audio_list_lock, K_FOREVER);
 	sys_slist_t *audiolist = s_mode == SONGS ? &s_song_audios : &s_joke_audios;
 	if (s_current_audio == NULL || s_current_audio == SYS_SLIST_PEEK_TAIL_CONTAINER(audiolist, s_current_audio, node)) {
 		s_current_audio = SYS_SLIST_PEEK_HEAD_CONTAINER(audiolist, s_current_audio, node);
@@ -105,44 +889,102 @@ const char *bmbbp_next_song(void)
 	}
 
 	if (s_current_audio != NULL) {
-		return s_current_audio->wav;
+		wav = s_current_audio->wav;
 	}
-	return NULL;
+	k_mutex_unlock(&audio_list_lock);
+	return wav;
 }
 
 const char *bmbbp_current_song(void)
 {
-	if (s_current_audio == NULL) {
-		return NULL;
+	const char *wav = NULL;
+
+	k_mutex_lock(&audio_list_lock, K_FOREVER);
+	if (s_current_audio != NULL) {
+		wav = s_current_audio->wav;
 	}
-	return s_current_audio->wav;
+	k_mutex_unlock(&audio_list_lock);
+	return wav;
 }
 
 void bmbbp_cancel_current_song(void)
 {
+	k_mutex_lock(&audio_list_lock, K_FOREVER);
 	if (s_current_audio != NULL) {
+		/* Remember where we got to so it can be resumed */
+		s_current_audio->resume_ms = audio_busy() ? MAX(audio_playtime(), 0) : 0;
 		audio_cancel();
 		motor_cancel();
 	}
+	k_mutex_unlock(&audio_list_lock);
 }
 
 const char *bmbbp_start_playing(void)
+{
+	return bmbbp_start_playing_at(0);
+}
+
+/* Called with the list lock held */
+static const char *start_playing_at(uint32_t offset_ms)
 {
 	if (s_current_audio == NULL) {
 		LOG_ERR("bmbbp start_playing called before next_song");
 		return NULL;
 	}
 
-	int64_t initial_timestamp = k_uptime_get();
-	LOG_INF("Initial timestamp: %lld", initial_timestamp);
+	LOG_INF("Starting %s at %u ms", s_current_audio->wav, offset_ms);
+	s_current_audio->resume_ms = 0;
 
-	if (audio_play(s_current_audio->wav) != 0) {
-		return NULL;
+	const struct pack_entry *pack = s_current_audio->pack;
+	if (s_current_audio->clip != NULL) {
+		if (audio_play_clip(s_current_audio->clip, offset_ms) != 0) {
+			return NULL;
+		}
+	} else if (pack != NULL) {
+		/* Already one contiguous run on the card, nothing to cache */
+		if (audio_play_packed(pack->wav.offset, pack->wav.size, offset_ms) != 0) {
+			return NULL;
+		}
+	} else {
+		char cached[CACHE_PATH_MAX];
+		const char *wav = cache_play(s_current_audio->wav, s_current_audio->dat, cached,
+				sizeof(cached));
+		if (audio_play(wav, offset_ms) != 0) {
+			return NULL;
+		}
 	}
 
-	if (motor_start(s_current_audio->instructions, initial_timestamp) != 0) {
+	s_playing_audio = s_current_audio;
+
+	/* From the top play everything, even the moves the fudge factor put
+	 * before 0.  Further in, skip the ones already gone by.
+	 */
+	size_t first = offset_ms == 0 ? 0 : find_instruction(&s_current_audio->track, offset_ms);
+	if (motor_start(&s_current_audio->track, first) != 0) {
 		return NULL;
 	}
 
 	return s_current_audio->wav;
 }
+
+const char *bmbbp_start_playing_at(uint32_t offset_ms)
+{
+	k_mutex_lock(&audio_list_lock, K_FOREVER);
+	const char *wav = start_playing_at(offset_ms);
+	k_mutex_unlock(&audio_list_lock);
+	return wav;
+}
+
+const char *bmbbp_resume_playing(void)
+{
+	const char *wav = NULL;
+
+	k_mutex_lock(&audio_list_lock, K_FOREVER);
+	if (s_current_audio == NULL) {
+		LOG_ERR("bmbbp resume_playing called before next_song");
+	} else {
+		wav = start_playing_at(s_current_audio->resume_ms);
+	}
+	k_mutex_unlock(&audio_list_lock);
+	return wav;
+}
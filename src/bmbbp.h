@@ -13,24 +13,81 @@ typedef enum {
 	MOUTH,
 	TAIL,
 	RELEASE,
+	/* Not in scripts, the scheduler adds these to end each pulse */
+	MOUTH_STOP,
+	TAIL_STOP,
 } bmbbp_movement_t;
 
 struct movement_instruction {
-	sys_snode_t node;
 	bmbbp_movement_t type;
 	int32_t timestamp;
+	/* Which fish to move, set when the tracks are merged */
+	uint8_t fish;
+};
+
+/* Movement instructions for a song, sorted by timestamp */
+struct movement_track {
+	struct movement_instruction *instructions;
+	size_t count;
 };
 
+struct pack_entry;
+struct audio_clip;
+
 struct bmbbp_audio {
 	sys_snode_t node;
 	const char *wav;
-	sys_slist_t instructions;
+	const char *dat;
+	/* Set if the song lives in the song pack rather than its own files */
+	const struct pack_entry *pack;
+	/* Set if the song is built into the firmware */
+	const struct audio_clip *clip;
+	/* All of the fishes' tracks merged into one schedule */
+	struct movement_track track;
+	/* Where to pick up from if the song was cancelled part way through */
+	uint32_t resume_ms;
 };
 
 int bmbbp_init();
 
 int bmbbp_add(bmbbp_mode_t mode, const char *wavfilename, const char *datfilename);
 
+int bmbbp_add_packed(const struct pack_entry *entry);
+
+int bmbbp_add_clip(bmbbp_mode_t mode, const char *name, const struct audio_clip *clip,
+		const char *script, size_t script_len);
+
+/* Reload a song whose files changed on the card, adding it if it's new */
+int bmbbp_refresh(bmbbp_mode_t mode, const char *wavfilename, const char *datfilename);
+
+/* Rename from over to, keeping the old to as to.OLD until from has taken
+ * its name
+ */
+int bmbbp_rename_over(const char *from, const char *to);
+
+/* Finish or undo a bmbbp_rename_over() of path that a power cut interrupted */
+int bmbbp_recover(const char *path);
+
+/* bmbbp_recover() every file in dir that has a .OLD left beside it */
+void bmbbp_recover_dir(const char *dir);
+
+/* bmbbp_rename_over() tmp onto path, unless path is the wav that's playing,
+ * in which case it returns -EBUSY
+ */
+int bmbbp_replace(const char *tmp, const char *path);
+
+struct bmbbp_parse_bench {
+	uint32_t lines;
+	/* Time to read the script with one fs_read() per line, as the old
+	 * reader did, and with the streaming parser.
+	 */
+	uint32_t per_line_us;
+	uint32_t streaming_us;
+};
+
+/* Time both .dat readers on a script of fixed 8 byte lines like 'M012300' */
+int bmbbp_bench_parse(const char *datfilename, struct bmbbp_parse_bench *bench);
+
 void bmbbp_toggle_mode(void);
 
 const char *bmbbp_next_song(void);
@@ -43,4 +100,8 @@ void bmbbp_cancel_current_song(void);
 
 const char *bmbbp_start_playing(void);
 
+const char *bmbbp_start_playing_at(uint32_t offset_ms);
+
+const char *bmbbp_resume_playing(void);
+
 #endif // __BMBBP_H__
@@ -0,0 +1,632 @@
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/fs/fs.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "audio.h"
+#include "cache.h"
+#include "power.h"
+
+/* Cache tier in the QSPI flash.  Songs from the SD card that get played
+ * often have their wav and dat copied into a LittleFS partition mounted at
+ * CACHE_MOUNT_PT (see the fstab in the board overlay) and served from there.
+ * Each song has one entry with a play count, copies are made by a low
+ * priority work queue while nothing is playing, and the least played songs
+ * are evicted to make room.  Counts are halved every CACHE_AGE_PLAYS plays so
+ * a song that stops being played gives its entry up to a new one.  Play
+ * counts are only written back to the flash from the work queue once
+ * playback has stopped, so a play doesn't cost an erase; the last few are
+ * lost on a reset.
+ */
+
+#define CACHE_MOUNT_PT "/CACHE:"
+#define CACHE_INDEX CACHE_MOUNT_PT"/INDEX"
+#define CACHE_INDEX_MAGIC 0x48434d42 /* "BMCH" */
+#define CACHE_INDEX_VERSION 2
+
+/* Leave a couple of LittleFS blocks free for metadata */
+#define CACHE_RESERVE (8 * 1024)
+#define COPY_CHUNK 4096
+/* How long to wait before trying to fill the cache again while audio is playing */
+#define FILL_RETRY K_SECONDS(5)
+/* Plays between halving every count */
+#define CACHE_AGE_PLAYS (2 * CONFIG_APP_CACHE_ENTRIES)
+/* No song is playing from the cache */
+#define NO_SLOT -1
+
+#define CACHE_STACK_SIZE 2048
+K_THREAD_STACK_DEFINE(cache_stack_area, CACHE_STACK_SIZE);
+
+LOG_MODULE_DECLARE(bmbb);
+
+enum cache_file {
+	CACHE_WAV,
+	CACHE_DAT,
+	CACHE_FILES,
+};
+
+static const char *const s_file_ext[CACHE_FILES] = { "WAV", "DAT" };
+
+/* One per song, an empty dat path means the song has no script to cache */
+struct cache_entry {
+	char path[CACHE_FILES][CACHE_PATH_MAX];
+	uint32_t plays;
+	uint32_t size[CACHE_FILES];
+	uint8_t cached;
+	/* Dropped while it was playing, the copy is deleted once it isn't */
+	uint8_t stale;
+} __packed;
+
+struct cache_index_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;
+} __packed;
+
+static struct {
+	bool ready;
+	/* Play counts have changed since the index was last written */
+	bool dirty;
+	/* Plays since the counts were last halved */
+	uint32_t plays_since_aging;
+	/* Slot the last song started from the cache was read from.  The audio
+	 * reader may still have it open so it is never deleted, it's only
+	 * released when another song starts.
+	 */
+	int playing;
+	struct k_mutex lock;
+	struct k_work_q queue;
+	struct k_work_delayable fill;
+	struct cache_entry entries[CONFIG_APP_CACHE_ENTRIES];
+} s_ctx;
+
+static uint8_t s_copy_buf[COPY_CHUNK] __aligned(4);
+
+static void cache_file_name(char *buf, size_t len, int slot, enum cache_file file)
+{
+	snprintf(buf, len, CACHE_MOUNT_PT"/C%02d.%s", slot, s_file_ext[file]);
+}
+
+static bool entry_used(const struct cache_entry *e)
+{
+	return e->path[CACHE_WAV][0] != '\0';
+}
+
+/* Called with the lock held.  Delete a slot's copies and empty it. */
+static void drop_entry(int slot)
+{
+	char name[CACHE_PATH_MAX];
+
+	if (s_ctx.entries[slot].cached) {
+		for (int f = 0; f < CACHE_FILES; ++f) {
+			cache_file_name(name, sizeof(name), slot, f);
+			fs_unlink(name);
+		}
+	}
+	memset(&s_ctx.entries[slot], 0, sizeof(s_ctx.entries[slot]));
+}
+
+/* Remove everything but the index, for a partition left by an older layout */
+static void wipe_files(void)
+{
+	struct fs_dir_t dir;
+	struct fs_dirent entry;
+	char name[CACHE_PATH_MAX];
+
+	fs_dir_t_init(&dir);
+	if (fs_opendir(&dir, CACHE_MOUNT_PT) != 0) {
+		return;
+	}
+	while (fs_readdir(&dir, &entry) == 0 && entry.name[0] != '\0') {
+		snprintf(name, sizeof(name), CACHE_MOUNT_PT"/%s", entry.name);
+		if (strcmp(name, CACHE_INDEX) != 0) {
+			fs_unlink(name);
+		}
+	}
+	fs_closedir(&dir);
+}
+
+/* Called with the lock held */
+static int save_index(void)
+{
+	struct fs_file_t file;
+	struct cache_index_header header = {
+		.magic = CACHE_INDEX_MAGIC,
+		.version = CACHE_INDEX_VERSION,
+		.count = CONFIG_APP_CACHE_ENTRIES,
+	};
+
+	fs_file_t_init(&file);
+	int err = fs_open(&file, CACHE_INDEX, FS_O_WRITE | FS_O_CREATE | FS_O_TRUNC);
+	if (err != 0) {
+		LOG_ERR("Failed to open cache index: %d", err);
+		return err;
+	}
+
+	ssize_t len = fs_write(&file, &header, sizeof(header));
+	if (len == sizeof(header)) {
+		len = fs_write(&file, s_ctx.entries, sizeof(s_ctx.entries));
+	}
+	fs_close(&file);
+
+	if (len < 0) {
+		LOG_ERR("Failed to write cache index: %d", len);
+		return len;
+	}
+	s_ctx.dirty = false;
+	return 0;
+}
+
+static int load_index(void)
+{
+	struct fs_file_t file;
+	struct cache_index_header header;
+
+	fs_file_t_init(&file);
+	int err = fs_open(&file, CACHE_INDEX, FS_O_READ);
+	if (err != 0) {
+		/* First boot with this partition */
+		return 0;
+	}
+
+	ssize_t len = fs_read(&file, &header, sizeof(header));
+	bool current = len == sizeof(header) && header.magic == CACHE_INDEX_MAGIC &&
+		header.version == CACHE_INDEX_VERSION &&
+		header.count == CONFIG_APP_CACHE_ENTRIES;
+	if (current) {
+		len = fs_read(&file, s_ctx.entries, sizeof(s_ctx.entries));
+		if (len != sizeof(s_ctx.entries)) {
+			memset(s_ctx.entries, 0, sizeof(s_ctx.entries));
+		}
+	}
+	fs_close(&file);
+	if (!current) {
+		LOG_INF("Cache index out of date, starting over");
+		wipe_files();
+		return 0;
+	}
+
+	/* Don't trust anything that didn't finish copying, and nothing is
+	 * playing yet so copies dropped while playing can go now
+	 */
+	char name[CACHE_PATH_MAX];
+	struct fs_dirent entry;
+	for (int i = 0; i < CONFIG_APP_CACHE_ENTRIES; ++i) {
+		struct cache_entry *e = &s_ctx.entries[i];
+		if (e->stale) {
+			drop_entry(i);
+			continue;
+		}
+		if (!e->cached) {
+			continue;
+		}
+		for (int f = 0; f < CACHE_FILES; ++f) {
+			if (e->path[f][0] == '\0') {
+				continue;
+			}
+			cache_file_name(name, sizeof(name), i, f);
+			if (fs_stat(name, &entry) != 0 || entry.size != e->size[f]) {
+				LOG_WRN("Dropping stale cache entry for %s", e->path[CACHE_WAV]);
+				drop_entry(i);
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Called with the lock held.  Finds the song path is the wav or dat of. */
+static int find_entry(const char *path, enum cache_file *file)
+{
+	for (int i = 0; i < CONFIG_APP_CACHE_ENTRIES; ++i) {
+		for (int f = 0; f < CACHE_FILES; ++f) {
+			if (s_ctx.entries[i].path[f][0] != '\0' &&
+				strncmp(s_ctx.entries[i].path[f], path, CACHE_PATH_MAX) == 0) {
+				*file = f;
+				return i;
+			}
+		}
+	}
+	return -ENOENT;
+}
+
+/* Called with the lock held */
+static void drop_stale(void)
+{
+	for (int i = 0; i < CONFIG_APP_CACHE_ENTRIES; ++i) {
+		if (s_ctx.entries[i].stale && i != s_ctx.playing) {
+			drop_entry(i);
+			s_ctx.dirty = true;
+		}
+	}
+}
+
+/* Called with the lock held */
+static void age_counts(void)
+{
+	if (++s_ctx.plays_since_aging < CACHE_AGE_PLAYS) {
+		return;
+	}
+	s_ctx.plays_since_aging = 0;
+	for (int i = 0; i < CONFIG_APP_CACHE_ENTRIES; ++i) {
+		s_ctx.entries[i].plays /= 2;
+	}
+}
+
+/* Called with the lock held.  An empty slot, or one whose count has aged
+ * away, preferring one without a copy to throw out.
+ */
+static int free_slot(void)
+{
+	int slot = -ENOSPC;
+
+	for (int i = 0; i < CONFIG_APP_CACHE_ENTRIES; ++i) {
+		struct cache_entry *e = &s_ctx.entries[i];
+		if (e->stale) {
+			continue;
+		}
+		if (!entry_used(e)) {
+			return i;
+		}
+		if (e->plays == 0 && i != s_ctx.playing &&
+			(slot < 0 || (s_ctx.entries[slot].cached && !e->cached))) {
+			slot = i;
+		}
+	}
+	return slot;
+}
+
+/* Called with the lock held.  Evicts cached entries played less than
+ * plays until there is room for size bytes.
+ */
+static bool make_room(uint32_t size, uint32_t plays, int keep)
+{
+	struct fs_statvfs stat;
+
+	while (true) {
+		if (fs_statvfs(CACHE_MOUNT_PT, &stat) != 0) {
+			return false;
+		}
+		uint64_t free = (uint64_t)stat.f_bfree * stat.f_frsize;
+		if (free >= (uint64_t)size + CACHE_RESERVE) {
+			return true;
+		}
+
+		int victim = -1;
+		for (int i = 0; i < CONFIG_APP_CACHE_ENTRIES; ++i) {
+			struct cache_entry *e = &s_ctx.entries[i];
+			if (i != keep && i != s_ctx.playing && e->cached && e->plays < plays &&
+				(victim < 0 || e->plays < s_ctx.entries[victim].plays)) {
+				victim = i;
+			}
+		}
+		if (victim < 0) {
+			return false;
+		}
+
+		LOG_INF("Evicting %s from cache", s_ctx.entries[victim].path[CACHE_WAV]);
+		for (int f = 0; f < CACHE_FILES; ++f) {
+			char name[CACHE_PATH_MAX];
+			cache_file_name(name, sizeof(name), victim, f);
+			fs_unlink(name);
+		}
+		s_ctx.entries[victim].cached = false;
+		save_index();
+	}
+}
+
+static int copy_file(const char *src, const char *dst, uint32_t size)
+{
+	struct fs_file_t in;
+	struct fs_file_t out;
+	uint32_t copied = 0;
+	int err;
+
+	fs_file_t_init(&in);
+	fs_file_t_init(&out);
+
+	err = fs_open(&in, src, FS_O_READ);
+	if (err != 0) {
+		return err;
+	}
+	err = fs_open(&out, dst, FS_O_WRITE | FS_O_CREATE | FS_O_TRUNC);
+	if (err != 0) {
+		fs_close(&in);
+		return err;
+	}
+
+	while (copied < size) {
+		if (audio_busy()) {
+			/* Don't compete with playback for the SD card */
+			err = -EAGAIN;
+			break;
+		}
+		ssize_t len = fs_read(&in, s_copy_buf, sizeof(s_copy_buf));
+		if (len <= 0) {
+			err = len < 0 ? len : -EIO;
+			break;
+		}
+		ssize_t written = fs_write(&out, s_copy_buf, len);
+		if (written != len) {
+			err = written < 0 ? written : -ENOSPC;
+			break;
+		}
+		copied += len;
+	}
+
+	fs_close(&out);
+	fs_close(&in);
+	return err;
+}
+
+/* Copy a song's files into slot under temporary names, then move them into
+ * place.  Called without the lock.
+ */
+static int copy_song(const struct cache_entry *song, int slot)
+{
+	char name[CACHE_PATH_MAX];
+	char tmp[CACHE_PATH_MAX];
+	int err = 0;
+
+	bool disk_ref = power_disk_get(song->path[CACHE_WAV]);
+	for (int f = 0; f < CACHE_FILES && err == 0; ++f) {
+		if (song->path[f][0] == '\0') {
+			continue;
+		}
+		cache_file_name(name, sizeof(name), slot, f);
+		snprintf(tmp, sizeof(tmp), "%s.TMP", name);
+		err = copy_file(song->path[f], tmp, song->size[f]);
+	}
+	if (disk_ref) {
+		power_disk_put();
+	}
+
+	for (int f = 0; f < CACHE_FILES; ++f) {
+		if (song->path[f][0] == '\0') {
+			continue;
+		}
+		cache_file_name(name, sizeof(name), slot, f);
+		snprintf(tmp, sizeof(tmp), "%s.TMP", name);
+		if (err == 0) {
+			/* LittleFS replaces a leftover copy from an earlier song */
+			err = fs_rename(tmp, name);
+		}
+		if (err != 0) {
+			fs_unlink(tmp);
+		}
+	}
+	return err;
+}
+
+static void fill_handler(struct k_work *work)
+{
+	char name[CACHE_PATH_MAX];
+	struct fs_dirent entry;
+	struct cache_entry candidate;
+	uint32_t size = 0;
+	int err = 0;
+
+	if (audio_busy()) {
+		k_work_reschedule_for_queue(&s_ctx.queue, &s_ctx.fill, FILL_RETRY);
+		return;
+	}
+
+	k_mutex_lock(&s_ctx.lock, K_FOREVER);
+	drop_stale();
+	if (s_ctx.dirty) {
+		save_index();
+	}
+
+	/* Most played song that isn't cached yet */
+	int slot = -1;
+	for (int i = 0; i < CONFIG_APP_CACHE_ENTRIES; ++i) {
+		struct cache_entry *e = &s_ctx.entries[i];
+		if (entry_used(e) && !e->cached && e->plays >= CONFIG_APP_CACHE_MIN_PLAYS &&
+			(slot < 0 || e->plays > s_ctx.entries[slot].plays)) {
+			slot = i;
+		}
+	}
+	if (slot < 0) {
+		k_mutex_unlock(&s_ctx.lock);
+		return;
+	}
+	candidate = s_ctx.entries[slot];
+
+	bool disk_ref = power_disk_get(candidate.path[CACHE_WAV]);
+	for (int f = 0; f < CACHE_FILES && err == 0; ++f) {
+		if (candidate.path[f][0] == '\0') {
+			continue;
+		}
+		err = fs_stat(candidate.path[f], &entry);
+		candidate.size[f] = entry.size;
+		size += entry.size;
+	}
+	if (disk_ref) {
+		power_disk_put();
+	}
+	if (err != 0 || !make_room(size, candidate.plays, slot)) {
+		/* Gone from the SD card or not worth evicting anything for, stop
+		 * counting it as a candidate until it's played again.
+		 */
+		s_ctx.entries[slot].plays = CONFIG_APP_CACHE_MIN_PLAYS - 1;
+		s_ctx.dirty = true;
+		k_mutex_unlock(&s_ctx.lock);
+		k_work_reschedule_for_queue(&s_ctx.queue, &s_ctx.fill, K_NO_WAIT);
+		return;
+	}
+	k_mutex_unlock(&s_ctx.lock);
+
+	int64_t start = k_uptime_get();
+	err = copy_song(&candidate, slot);
+	if (err != 0) {
+		if (err == -EAGAIN) {
+			k_work_reschedule_for_queue(&s_ctx.queue, &s_ctx.fill, FILL_RETRY);
+		} else {
+			LOG_ERR("Failed to cache %s: %d", candidate.path[CACHE_WAV], err);
+		}
+		return;
+	}
+	LOG_INF("Cached %s (%u bytes in %lld ms)", candidate.path[CACHE_WAV], size,
+		k_uptime_get() - start);
+
+	k_mutex_lock(&s_ctx.lock, K_FOREVER);
+	struct cache_entry *e = &s_ctx.entries[slot];
+	if (memcmp(e->path, candidate.path, sizeof(e->path)) == 0) {
+		memcpy(e->size, candidate.size, sizeof(e->size));
+		e->cached = true;
+		save_index();
+	} else {
+		/* Slot was reused while we were copying, nothing can have the
+		 * copies open yet
+		 */
+		for (int f = 0; f < CACHE_FILES; ++f) {
+			cache_file_name(name, sizeof(name), slot, f);
+			fs_unlink(name);
+		}
+	}
+	k_mutex_unlock(&s_ctx.lock);
+
+	/* See if anything else is waiting */
+	k_work_reschedule_for_queue(&s_ctx.queue, &s_ctx.fill, K_NO_WAIT);
+}
+
+int cache_init(void)
+{
+	struct fs_statvfs stat;
+
+	k_mutex_init(&s_ctx.lock);
+	memset(s_ctx.entries, 0, sizeof(s_ctx.entries));
+	s_ctx.playing = NO_SLOT;
+
+	/* The partition is mounted from the fstab */
+	int err = fs_statvfs(CACHE_MOUNT_PT, &stat);
+	if (err != 0) {
+		LOG_ERR("Cache partition not mounted: %d", err);
+		return err;
+	}
+
+	load_index();
+
+	k_work_queue_init(&s_ctx.queue);
+	k_work_queue_start(&s_ctx.queue, cache_stack_area,
+			K_THREAD_STACK_SIZEOF(cache_stack_area),
+			CONFIG_APP_CACHE_PRIORITY, NULL);
+	k_thread_name_set(k_work_queue_thread_get(&s_ctx.queue), "cache");
+	k_work_init_delayable(&s_ctx.fill, fill_handler);
+
+	s_ctx.ready = true;
+	LOG_INF("Cache: %lu of %lu blocks free", stat.f_bfree, stat.f_blocks);
+
+	/* Pick up anything that was waiting to be copied before a reboot */
+	k_work_reschedule_for_queue(&s_ctx.queue, &s_ctx.fill, FILL_RETRY);
+	return 0;
+}
+
+const char *cache_resolve(const char *path, char *buf, size_t len)
+{
+	enum cache_file file;
+
+	if (!s_ctx.ready) {
+		return path;
+	}
+
+	k_mutex_lock(&s_ctx.lock, K_FOREVER);
+	int slot = find_entry(path, &file);
+	bool cached = slot >= 0 && s_ctx.entries[slot].cached;
+	k_mutex_unlock(&s_ctx.lock);
+
+	if (!cached) {
+		return path;
+	}
+	cache_file_name(buf, len, slot, file);
+	return buf;
+}
+
+const char *cache_play(const char *wav, const char *dat, char *buf, size_t len)
+{
+	enum cache_file file;
+
+	/* A song still playing keeps its copy pinned, this one won't start */
+	if (!s_ctx.ready || audio_busy() || strlen(wav) >= CACHE_PATH_MAX ||
+		(dat != NULL && strlen(dat) >= CACHE_PATH_MAX)) {
+		return wav;
+	}
+
+	k_mutex_lock(&s_ctx.lock, K_FOREVER);
+	age_counts();
+	int slot = find_entry(wav, &file);
+	if (slot < 0) {
+		slot = free_slot();
+		if (slot >= 0) {
+			struct cache_entry *e = &s_ctx.entries[slot];
+			drop_entry(slot);
+			strncpy(e->path[CACHE_WAV], wav, CACHE_PATH_MAX - 1);
+			if (dat != NULL) {
+				strncpy(e->path[CACHE_DAT], dat, CACHE_PATH_MAX - 1);
+			}
+		}
+	}
+
+	const char *path = wav;
+	s_ctx.playing = NO_SLOT;
+	if (slot >= 0) {
+		s_ctx.entries[slot].plays++;
+		s_ctx.dirty = true;
+		if (s_ctx.entries[slot].cached) {
+			s_ctx.playing = slot;
+			cache_file_name(buf, len, slot, CACHE_WAV);
+			path = buf;
+		}
+	}
+	k_mutex_unlock(&s_ctx.lock);
+
+	/* Save the count, and copy the song if it's popular enough now, once
+	 * it's done
+	 */
+	k_work_reschedule_for_queue(&s_ctx.queue, &s_ctx.fill, FILL_RETRY);
+	return path;
+}
+
+void cache_foreach(void (*cb)(const char *path, uint32_t plays, bool cached, void *user_data),
+		void *user_data)
+{
+	k_mutex_lock(&s_ctx.lock, K_FOREVER);
+	for (int i = 0; i < CONFIG_APP_CACHE_ENTRIES; ++i) {
+		struct cache_entry *e = &s_ctx.entries[i];
+		if (entry_used(e)) {
+			cb(e->path[CACHE_WAV], e->plays, e->cached, user_data);
+		}
+	}
+	k_mutex_unlock(&s_ctx.lock);
+}
+
+void cache_invalidate(const char *path)
+{
+	enum cache_file file;
+
+	if (!s_ctx.ready) {
+		return;
+	}
+
+	k_mutex_lock(&s_ctx.lock, K_FOREVER);
+	int slot = find_entry(path, &file);
+	if (slot >= 0) {
+		struct cache_entry *e = &s_ctx.entries[slot];
+		if (slot == s_ctx.playing && e->cached) {
+			/* The reader may still have the copy open, drop_stale()
+			 * deletes it once another song has started
+			 */
+			memset(e->path, 0, sizeof(e->path));
+			e->plays = 0;
+			e->stale = true;
+		} else {
+			/* A copy in progress sees the path change and throws
+			 * itself away
+			 */
+			drop_entry(slot);
+		}
+		save_index();
+	}
+	k_mutex_unlock(&s_ctx.lock);
+}
@@ -0,0 +1,63 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Longest SD card path the cache will track */
+#define CACHE_PATH_MAX 64
+
+#if defined(CONFIG_APP_CACHE)
+
+int cache_init(void);
+
+/* Returns the path to read from, either the cached copy (written to buf) or
+ * path itself if it isn't cached.
+ */
+const char *cache_resolve(const char *path, char *buf, size_t len);
+
+/* Count a play of the song wav with script dat (or NULL), queueing both to
+ * be copied once it's popular enough.  Returns the wav to play like
+ * cache_resolve(), a copy handed out here isn't deleted until another song
+ * has started.
+ */
+const char *cache_play(const char *wav, const char *dat, char *buf, size_t len);
+
+void cache_foreach(void (*cb)(const char *path, uint32_t plays, bool cached, void *user_data),
+		void *user_data);
+
+/* Forget the song path belongs to after it has changed on the SD card,
+ * dropping any cached copy
+ */
+void cache_invalidate(const char *path);
+
+#else
+
+static inline int cache_init(void)
+{
+	return 0;
+}
+
+static inline const char *cache_resolve(const char *path, char *buf, size_t len)
+{
+	return path;
+}
+
+static inline const char *cache_play(const char *wav, const char *dat, char *buf, size_t len)
+{
+	return wav;
+}
+
+static inline void cache_foreach(void (*cb)(const char *path, uint32_t plays, bool cached,
+		void *user_data), void *user_data)
+{
+}
+
+static inline void cache_invalidate(const char *path)
+{
+}
+
+#endif
+
+#endif // __CACHE_H__
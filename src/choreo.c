@@ -0,0 +1,173 @@
+#include <zephyr/kernel.h>
+
+#include "choreo.h"
+#include "motor.h"
+
+/* Load time optimizer for movement scripts.  Walks each fish's track once
+ * tracking what the motors are doing and drops anything that wouldn't
+ * change it:
+ * - MOUTH or TAIL while the previous pulse is still going (or closer than
+ *   the minimum gap)
+ * - HEAD while the head is already held
+ * - RELEASE when the body is already released
+ * - MOUTH that would keep the mouth motor driven for more than
+ *   CONFIG_APP_MOUTH_MAX_DUTY percent of any CONFIG_APP_MOUTH_DUTY_WINDOW_MS
+ * The body motor stalls against its end stop while the head is held, so a
+ * RELEASE is added to any hold longer than CONFIG_APP_HEAD_MAX_HOLD_MS,
+ * including one still going at the end of the track.
+ */
+
+BUILD_ASSERT(CONFIG_APP_MOUTH_MIN_GAP_MS >= MOTOR_MOUTH_PULSE_MS,
+	"Mouth gap must be at least the mouth pulse");
+BUILD_ASSERT(CONFIG_APP_TAIL_MIN_GAP_MS >= MOTOR_TAIL_PULSE_MS,
+	"Tail gap must be at least the tail pulse");
+
+/* Mouth pulses allowed to start within one duty window */
+#define MOUTH_DUTY_PULSES (CONFIG_APP_MOUTH_DUTY_WINDOW_MS * CONFIG_APP_MOUTH_MAX_DUTY / 100 / \
+	MOTOR_MOUTH_PULSE_MS)
+BUILD_ASSERT(MOUTH_DUTY_PULSES > 0, "Mouth duty window must fit at least one pulse");
+
+enum body_state {
+	BODY_RELEASED,
+	BODY_HEAD,
+	BODY_TAIL,
+};
+
+struct choreo_state {
+	enum body_state body;
+	/* When the current head hold or tail pulse started */
+	int32_t body_since;
+	int32_t last_mouth;
+	int32_t last_tail;
+	bool mouth_seen;
+	bool tail_seen;
+	/* Start times of the last MOUTH_DUTY_PULSES mouth pulses kept, the
+	 * oldest at mouth_kept % MOUTH_DUTY_PULSES once it has wrapped
+	 */
+	int32_t mouth_recent[MOUTH_DUTY_PULSES];
+	uint32_t mouth_kept;
+};
+
+static void append(struct movement_instruction *out, size_t *n,
+		bmbbp_movement_t type, int32_t timestamp)
+{
+	out[*n].type = type;
+	out[*n].timestamp = timestamp;
+	out[*n].fish = 0;
+	(*n)++;
+}
+
+/* Release the held head as soon as the hold limit is up */
+static void release_head(struct choreo_state *st, struct movement_instruction *out,
+		size_t *n, struct choreo_report *report)
+{
+	append(out, n, RELEASE, st->body_since + CONFIG_APP_HEAD_MAX_HOLD_MS);
+	st->body = BODY_RELEASED;
+	report->release_added++;
+}
+
+/* Release a head that's been held too long before time t */
+static void limit_head_hold(struct choreo_state *st, struct movement_instruction *out,
+		size_t *n, int32_t t, struct choreo_report *report)
+{
+	if (st->body == BODY_HEAD && t - st->body_since > CONFIG_APP_HEAD_MAX_HOLD_MS) {
+		release_head(st, out, n, report);
+	}
+}
+
+/* Returns true if the instruction changes what the motors are doing */
+static bool keep(struct choreo_state *st, const struct movement_instruction *inst,
+		struct choreo_report *report)
+{
+	int32_t t = inst->timestamp;
+
+	if (st->body == BODY_TAIL && t - st->body_since >= MOTOR_TAIL_PULSE_MS) {
+		/* The tail pulse ends with the body released */
+		st->body = BODY_RELEASED;
+	}
+
+	switch (inst->type) {
+	case MOUTH:
+		if (st->mouth_seen && t - st->last_mouth < CONFIG_APP_MOUTH_MIN_GAP_MS) {
+			report->mouth_dropped++;
+			return false;
+		}
+		if (st->mouth_kept >= MOUTH_DUTY_PULSES &&
+			t - st->mouth_recent[st->mouth_kept % MOUTH_DUTY_PULSES] <
+				CONFIG_APP_MOUTH_DUTY_WINDOW_MS) {
+			/* The mouth motor would run hot */
+			report->mouth_limited++;
+			return false;
+		}
+		st->mouth_recent[st->mouth_kept % MOUTH_DUTY_PULSES] = t;
+		st->mouth_kept++;
+		st->mouth_seen = true;
+		st->last_mouth = t;
+		return true;
+	case TAIL:
+		if (st->tail_seen && t - st->last_tail < CONFIG_APP_TAIL_MIN_GAP_MS) {
+			report->tail_dropped++;
+			return false;
+		}
+		st->tail_seen = true;
+		st->last_tail = t;
+		st->body = BODY_TAIL;
+		st->body_since = t;
+		return true;
+	case HEAD:
+		if (st->body == BODY_HEAD) {
+			report->head_dropped++;
+			return false;
+		}
+		st->body = BODY_HEAD;
+		st->body_since = t;
+		return true;
+	case RELEASE:
+		if (st->body == BODY_RELEASED) {
+			report->release_dropped++;
+			return false;
+		}
+		st->body = BODY_RELEASED;
+		return true;
+	default:
+		return true;
+	}
+}
+
+int choreo_optimize(struct movement_track *track, struct choreo_report *report)
+{
+	struct choreo_state st = {
+		.body = BODY_RELEASED,
+	};
+	size_t heads = 0;
+
+	for (size_t i = 0; i < track->count; ++i) {
+		if (track->instructions[i].type == HEAD) {
+			heads++;
+		}
+	}
+
+	/* Every head hold can gain a RELEASE */
+	struct movement_instruction *out = k_malloc((track->count + heads) * sizeof(*out));
+	if (out == NULL && track->count + heads > 0) {
+		return -ENOMEM;
+	}
+
+	size_t n = 0;
+	for (size_t i = 0; i < track->count; ++i) {
+		const struct movement_instruction *inst = &track->instructions[i];
+		limit_head_hold(&st, out, &n, inst->timestamp, report);
+		if (keep(&st, inst, report)) {
+			append(out, &n, inst->type, inst->timestamp);
+		}
+	}
+	/* Don't leave the head held at the end of the song either */
+	if (st.body == BODY_HEAD) {
+		release_head(&st, out, &n, report);
+	}
+
+	k_free(track->instructions);
+	track->instructions = out;
+	track->count = n;
+	return 0;
+}
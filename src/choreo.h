@@ -0,0 +1,23 @@
+#ifndef __CHOREO_H__
+#define __CHOREO_H__
+
+#include "bmbbp.h"
+
+/* What the optimizer changed in a track */
+struct choreo_report {
+	uint32_t reordered;
+	uint32_t mouth_dropped;
+	/* Mouth moves over the duty cycle limit */
+	uint32_t mouth_limited;
+	uint32_t tail_dropped;
+	uint32_t head_dropped;
+	uint32_t release_dropped;
+	uint32_t release_added;
+};
+
+/* Clean up a sorted track in place so it only holds moves the motors can
+ * actually make.  The track's array may be reallocated.
+ */
+int choreo_optimize(struct movement_track *track, struct choreo_report *report);
+
+#endif // __CHOREO_H__
@@ -0,0 +1,66 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "adpcm.h"
+#include "audio.h"
+#include "bmbbp.h"
+#include "clip.h"
+
+/* The default song, built in from CONFIG_APP_DEFAULT_SONG_WAV and
+ * CONFIG_APP_DEFAULT_SONG_DAT by tools/mkclip.py (see CMakeLists.txt).  It
+ * plays straight out of the internal flash, so it's there the moment the
+ * fish boots whether or not there's an SD card.
+ */
+
+#define CLIP_NAME "DEFAULT.WAV"
+
+/* Same as the wav format codes */
+#define CLIP_FORMAT_PCM 1
+#define CLIP_FORMAT_IMA_ADPCM 0x11
+
+LOG_MODULE_DECLARE(bmbb);
+
+struct clip_header {
+	uint32_t samples;
+	uint16_t format;
+	uint16_t block_size;
+} __packed;
+
+static const uint8_t s_song[] __aligned(4) = {
+#include "default_song.inc"
+};
+
+static const char s_script[] = {
+#include "default_song_dat.inc"
+};
+
+static struct audio_clip s_clip;
+
+int clip_init(void)
+{
+	const struct clip_header *header = (const struct clip_header *)s_song;
+	size_t size = sizeof(s_song) - sizeof(*header);
+	size_t needed;
+
+	if (header->format == CLIP_FORMAT_IMA_ADPCM && header->block_size == ADPCM_BLOCK_SIZE) {
+		uint32_t last = header->samples % ADPCM_SAMPLES_PER_BLOCK;
+
+		/* The last block stops after its last sample */
+		needed = header->samples / ADPCM_SAMPLES_PER_BLOCK * ADPCM_BLOCK_SIZE +
+			(last > 0 ? 4 + last / 2 : 0);
+	} else if (header->format == CLIP_FORMAT_PCM) {
+		needed = header->samples * sizeof(int16_t);
+	} else {
+		LOG_ERR("Built in song has unknown format 0x%x", header->format);
+		return -EINVAL;
+	}
+	if (needed > size) {
+		LOG_ERR("Built in song is truncated");
+		return -EINVAL;
+	}
+
+	s_clip.data = s_song + sizeof(*header);
+	s_clip.samples = header->samples;
+	s_clip.adpcm = header->format == CLIP_FORMAT_IMA_ADPCM;
+	return bmbbp_add_clip(SONGS, CLIP_NAME, &s_clip, s_script, sizeof(s_script));
+}
@@ -0,0 +1,20 @@
+#ifndef __CLIP_H__
+#define __CLIP_H__
+
+#include <errno.h>
+
+#if defined(CONFIG_APP_DEFAULT_SONG)
+
+/* Add the song built into the firmware to the song list */
+int clip_init(void);
+
+#else
+
+static inline int clip_init(void)
+{
+	return -ENOTSUP;
+}
+
+#endif
+
+#endif // __CLIP_H__
@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <strings.h>
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/drivers/hwinfo.h>
@@ -14,7 +15,12 @@
 #include <zephyr/storage/disk_access.h>
 #include <zephyr/sys/poweroff.h>
 
+#include "audio.h"
 #include "bmbbp.h"
+#include "cache.h"
+#include "clip.h"
+#include "pack.h"
+#include "power.h"
 
 #define DISK_DRIVE_NAME "SD"
 #define DISK_MOUNT_PT "/"DISK_DRIVE_NAME":"
@@ -29,7 +35,8 @@ static FATFS fat_fs;
 static struct fs_mount_t mp = {
 	.type = FS_FATFS,
 	.fs_data = &fat_fs,
-	.flags = FS_MOUNT_FLAG_READ_ONLY | FS_MOUNT_FLAG_NO_FORMAT,
+	/* Writable for `bmbb upload` */
+	.flags = FS_MOUNT_FLAG_NO_FORMAT,
 };
 
 #define FS_RET_OK FR_OK
@@ -67,6 +74,15 @@ static void shutdown_handler(struct k_timer *timer_id)
 
 K_TIMER_DEFINE(shutdown_timer, shutdown_handler, NULL);
 
+/* Woken up from pressing the button, play the song */
+static void play_next_song(void)
+{
+	bmbbp_cancel_current_song();
+	const char *wav = bmbbp_next_song();
+	LOG_INF("Playing song %s", wav);
+	bmbbp_start_playing();
+}
+
 /* List dir entry by path
  *
  * @param path Absolute path to list
@@ -81,6 +97,11 @@ static int find_songs(bmbbp_mode_t mode, const char *path)
 	struct fs_file_t filep;
 	static struct fs_dirent entry;
 
+	/* An upload cut off mid replace leaves the old file as a .OLD */
+	if (IS_ENABLED(CONFIG_APP_UPLOAD)) {
+		bmbbp_recover_dir(path);
+	}
+
 	fs_dir_t_init(&dirp);
 	fs_file_t_init(&filep);
 
@@ -102,7 +123,8 @@ static int find_songs(bmbbp_mode_t mode, const char *path)
 
 		if (entry.type != FS_DIR_ENTRY_DIR) {
 			size_t namelen = strlen(entry.name);
-			if (strncmp(entry.name + namelen - 4, ".WAV", 4) == 0)
+			/* Long file names keep their case, so Song.wav counts too */
+			if (namelen > 4 && strncasecmp(entry.name + namelen - 4, ".WAV", 4) == 0)
 			{
 				LOG_INF("Found wav file %s", entry.name);
 				/* Find the .dat file with the instructions */
@@ -153,33 +175,63 @@ static void input_cb(struct input_event *evt, void *user_data)
 static const struct device *const longpress_dev = DEVICE_DT_GET(DT_NODELABEL(longpress));
 INPUT_CALLBACK_DEFINE(longpress_dev, input_cb, NULL);
 
+/* The longpress device only reports a short press once the button is let go,
+ * so watch the raw button to start waking the SD card and the I2S while it's
+ * still down.
+ */
+static void button_cb(struct input_event *evt, void *user_data)
+{
+	ARG_UNUSED(user_data);
+
+	if ((evt->code == INPUT_KEY_0 || evt->code == INPUT_KEY_1) && evt->value == 1) {
+		power_disk_prepare();
+		audio_prepare();
+	}
+}
+
+static const struct device *const buttons_dev = DEVICE_DT_GET(DT_PARENT(DT_NODELABEL(button1)));
+INPUT_CALLBACK_DEFINE(buttons_dev, button_cb, NULL);
+
 int main(void)
 {
-	uint32_t reset_cause;
+	uint32_t reset_cause = 0;
 	hwinfo_get_reset_cause(&reset_cause);
 	hwinfo_clear_reset_cause();
 	LOG_INF("Reset cause: 0x%04x", reset_cause);
 
+	cache_init();
+	bmbbp_init();
+
+	bool builtin = clip_init() == 0;
+	bool woken = reset_cause & RESET_LOW_POWER_WAKE;
+	if (woken && builtin) {
+		/* The built in song doesn't need the card, start it right away and
+		 * load the card behind it without getting in the audio's way.
+		 */
+		play_next_song();
+		k_thread_priority_set(k_current_get(), CONFIG_APP_AUDIO_READER_PRIORITY + 1);
+	}
+
 	mp.mnt_point = disk_mount_pt;
 
 	int res = fs_mount(&mp);
 
 	if (res == FS_RET_OK) {
 		LOG_INF("Disk mounted.");
-		find_songs(SONGS, disk_songs_dir);
-		find_songs(JOKES, disk_jokes_dir);
+		if (pack_init() != 0) {
+			find_songs(SONGS, disk_songs_dir);
+			find_songs(JOKES, disk_jokes_dir);
+		}
+	} else if (builtin) {
+		LOG_ERR("Error mounting disk, only the built in song is available.");
 	} else {
 		LOG_ERR("Error mounting disk.");
 	}
 
-	bmbbp_init();
+	power_init();
 
-	if (reset_cause & RESET_LOW_POWER_WAKE) {
-		// Woken up from pressing the button, play the song
-		bmbbp_cancel_current_song();
-		const char *wav = bmbbp_next_song();
-		LOG_INF("Playing song %s", wav);
-		bmbbp_start_playing();
+	if (woken && !builtin) {
+		play_next_song();
 	}
 
 	k_timer_start(&shutdown_timer, SHUTDOWN_TIME, K_NO_WAIT);
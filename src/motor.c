@@ -1,17 +1,36 @@
+#include <string.h>
+
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
-#include <zephyr/sys/slist.h>
 
 #include "bmbbp.h"
 #include "motor.h"
 #include "audio.h"
 
-static const struct gpio_dt_spec mouth0 = GPIO_DT_SPEC_GET(DT_NODELABEL(mouth0), gpios);
-static const struct gpio_dt_spec mouth1 = GPIO_DT_SPEC_GET(DT_NODELABEL(mouth1), gpios);
+#define DT_DRV_COMPAT bmbb_fish
+
+BUILD_ASSERT(MOTOR_FISH_COUNT > 0, "No bmbb,fish nodes in the devicetree");
+
+/* The H-bridge inputs for each fish, see dts/bindings/bmbb,fish.yaml */
+struct fish {
+	struct gpio_dt_spec mouth0;
+	struct gpio_dt_spec mouth1;
+	struct gpio_dt_spec body0;
+	struct gpio_dt_spec body1;
+};
 
-static const struct gpio_dt_spec body0 = GPIO_DT_SPEC_GET(DT_NODELABEL(body0), gpios);
-static const struct gpio_dt_spec body1 = GPIO_DT_SPEC_GET(DT_NODELABEL(body1), gpios);
+#define FISH_DEFINE(inst)							\
+	{									\
+		.mouth0 = GPIO_DT_SPEC_INST_GET_BY_IDX(inst, mouth_gpios, 0),	\
+		.mouth1 = GPIO_DT_SPEC_INST_GET_BY_IDX(inst, mouth_gpios, 1),	\
+		.body0 = GPIO_DT_SPEC_INST_GET_BY_IDX(inst, body_gpios, 0),	\
+		.body1 = GPIO_DT_SPEC_INST_GET_BY_IDX(inst, body_gpios, 1),	\
+	},
+
+static const struct fish s_fish[] = {
+	DT_INST_FOREACH_STATUS_OKAY(FISH_DEFINE)
+};
 
 /* Define the thread to control the motors */
 #define MOTOR_STACK_SIZE 512
@@ -20,105 +39,303 @@ struct k_thread motor_thread_data;
 
 LOG_MODULE_DECLARE(bmbb);
 
+/* Longest the scheduler sleeps before checking the audio clock again, so it
+ * follows the audio if the stream has to restart.
+ */
+#define MAX_SLEEP_MS 100
+
+enum body_state {
+	BODY_RELEASED,
+	BODY_HEAD,
+	BODY_TAIL,
+};
+
+/* Where the schedule has left each fish's motors */
+struct fish_state {
+	bool mouth_open;
+	enum body_state body;
+};
+
 static struct {
 	k_tid_t tid;
-	bool cancel;
-	sys_slist_t instructions;
-	struct movement_instruction *current_instruction;
+	volatile bool cancel;
+	const struct movement_track *schedule;
+	size_t next;
+	struct fish_state state[MOTOR_FISH_COUNT];
+	struct motor_stats stats;
 } s_ctx;
 
-static void move_head(void)
+static void move_head(const struct fish *fish)
+{
+	gpio_pin_set_dt(&fish->body1, 0);
+	gpio_pin_set_dt(&fish->body0, 1);
+}
+
+static void open_mouth(const struct fish *fish)
+{
+	gpio_pin_set_dt(&fish->mouth0, 0);
+	gpio_pin_set_dt(&fish->mouth1, 1);
+}
+
+static void close_mouth(const struct fish *fish)
+{
+	gpio_pin_set_dt(&fish->mouth1, 0);
+}
+
+static void move_tail(const struct fish *fish)
 {
-	gpio_pin_set_dt(&body1, 0);
-	gpio_pin_set_dt(&body0, 1);
+	gpio_pin_set_dt(&fish->body0, 0);
+	gpio_pin_set_dt(&fish->body1, 1);
 }
 
-static void open_mouth(uint32_t delay_ms)
+static void stop_tail(const struct fish *fish)
 {
-	gpio_pin_set_dt(&mouth0, 0);
-	gpio_pin_set_dt(&mouth1, 1);
-	k_msleep(delay_ms);
-	gpio_pin_set_dt(&mouth1, 0);
+	gpio_pin_set_dt(&fish->body1, 0);
 }
 
-static void move_tail(uint32_t delay_ms)
+static void release_body(const struct fish *fish)
 {
-	gpio_pin_set_dt(&body0, 0);
-	gpio_pin_set_dt(&body1, 1);
-	k_msleep(delay_ms);
-	gpio_pin_set_dt(&body1, 0);
+	gpio_pin_set_dt(&fish->body0, 0);
+	gpio_pin_set_dt(&fish->body1, 0);
 }
 
-static void release_body(void)
+static void track_state(struct fish_state *state, const struct movement_instruction *inst)
 {
-	gpio_pin_set_dt(&body0, 0);
-	gpio_pin_set_dt(&body1, 0);
+	switch (inst->type) {
+	case HEAD:
+		state->body = BODY_HEAD;
+		break;
+	case MOUTH:
+		state->mouth_open = true;
+		break;
+	case MOUTH_STOP:
+		state->mouth_open = false;
+		break;
+	case TAIL:
+		state->body = BODY_TAIL;
+		break;
+	case TAIL_STOP:
+	case RELEASE:
+		state->body = BODY_RELEASED;
+		break;
+	}
 }
 
 static void process_instruction(const struct movement_instruction *inst)
 {
+	const struct fish *fish = &s_fish[inst->fish];
+
 	switch (inst->type) {
 	case HEAD:
-		move_head();
+		move_head(fish);
 		break;
 	case MOUTH:
-		open_mouth(100);
+		open_mouth(fish);
+		break;
+	case MOUTH_STOP:
+		close_mouth(fish);
 		break;
 	case TAIL:
-		move_tail(100);
+		move_tail(fish);
+		break;
+	case TAIL_STOP:
+		stop_tail(fish);
 		break;
 	case RELEASE:
-		release_body();
+		release_body(fish);
 		break;
 	}
+	track_state(&s_ctx.state[inst->fish], inst);
+}
+
+/* Starting part way in, put each fish where the moves before the start
+ * left it, so a head hold or a pulse already under way carries on.
+ */
+static void restore_state(void)
+{
+	for (size_t i = 0; i < s_ctx.next; ++i) {
+		const struct movement_instruction *inst = &s_ctx.schedule->instructions[i];
+		track_state(&s_ctx.state[inst->fish], inst);
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(s_fish); ++i) {
+		if (s_ctx.state[i].body == BODY_HEAD) {
+			move_head(&s_fish[i]);
+		} else if (s_ctx.state[i].body == BODY_TAIL) {
+			move_tail(&s_fish[i]);
+		}
+		if (s_ctx.state[i].mouth_open) {
+			open_mouth(&s_fish[i]);
+		}
+	}
 }
 
+static void record_jitter(int32_t late_ms)
+{
+	s_ctx.stats.events++;
+	s_ctx.stats.total_late_ms += late_ms;
+	if (late_ms > s_ctx.stats.max_late_ms) {
+		s_ctx.stats.max_late_ms = late_ms;
+	}
+}
+
+/* A single scheduler walks the merged schedule for every fish, so each wakeup
+ * costs O(1) per event no matter how many fish there are.
+ */
 void handle_motors(void *, void *, void *)
 {
-	struct movement_instruction *inst = SYS_SLIST_PEEK_HEAD_CONTAINER(&s_ctx.instructions, inst, node);
+	/* Nothing to sync to until the first sample goes out */
+	while (!s_ctx.cancel && audio_busy() && !audio_started()) {
+		k_msleep(1);
+	}
+	if (!s_ctx.cancel) {
+		restore_state();
+	}
 
-	while (inst != NULL && !s_ctx.cancel) {
-		uint32_t playtime = audio_playtime();
+	while (s_ctx.next < s_ctx.schedule->count && !s_ctx.cancel) {
+		const struct movement_instruction *inst = &s_ctx.schedule->instructions[s_ctx.next];
+		int32_t playtime = audio_playtime();
 		if (inst->timestamp > playtime) {
-			k_msleep(inst->timestamp - playtime);
+			k_msleep(MIN(inst->timestamp - playtime, MAX_SLEEP_MS));
+			continue;
 		}
 		process_instruction(inst);
-		inst = SYS_SLIST_PEEK_NEXT_CONTAINER(inst, node);
+		record_jitter(playtime - inst->timestamp);
+		s_ctx.next++;
+	}
+
+	/* Don't leave a motor driven if we were cancelled mid-pulse or with the
+	 * head held, the body motor would sit stalled against its end stop.
+	 * Fish the schedule already let go of are left alone.
+	 */
+	for (size_t i = 0; i < ARRAY_SIZE(s_fish); ++i) {
+		if (s_ctx.state[i].mouth_open) {
+			close_mouth(&s_fish[i]);
+		}
+		if (s_ctx.state[i].body != BODY_RELEASED) {
+			release_body(&s_fish[i]);
+		}
 	}
 }
 
-int motor_init(void)
+/* Append one instruction, adding the matching stop event for pulsed motors */
+static size_t schedule_add(struct movement_instruction *out, size_t n,
+		const struct movement_instruction *inst)
 {
-	int ret;
+	out[n++] = *inst;
+	if (inst->type == MOUTH || inst->type == TAIL) {
+		out[n] = *inst;
+		out[n].type = inst->type == MOUTH ? MOUTH_STOP : TAIL_STOP;
+		out[n].timestamp += inst->type == MOUTH ? MOTOR_MOUTH_PULSE_MS : MOTOR_TAIL_PULSE_MS;
+		n++;
+	}
+	return n;
+}
+
+static bool schedule_before(const struct movement_instruction *a, const struct movement_instruction *b)
+{
+	return a->timestamp < b->timestamp ||
+		(a->timestamp == b->timestamp && a->fish < b->fish);
+}
 
-	if (!gpio_is_ready_dt(&mouth0) ||
-		!gpio_is_ready_dt(&mouth1)	||
-		!gpio_is_ready_dt(&body0)	||
-		!gpio_is_ready_dt(&body1)) 
-	{
-		return -1;
+int motor_build_schedule(const struct movement_track *tracks, size_t fish_count,
+		struct movement_track *schedule)
+{
+	size_t count = 0;
+	size_t cursor[MOTOR_FISH_COUNT] = { 0 };
+
+	fish_count = MIN(fish_count, MOTOR_FISH_COUNT);
+	for (size_t i = 0; i < fish_count; ++i) {
+		for (size_t j = 0; j < tracks[i].count; ++j) {
+			bool pulsed = tracks[i].instructions[j].type == MOUTH ||
+				tracks[i].instructions[j].type == TAIL;
+			count += pulsed ? 2 : 1;
+		}
 	}
 
-	ret = gpio_pin_configure_dt(&mouth0, GPIO_OUTPUT_INACTIVE);
-	if (ret < 0) {
-		return ret;
+	schedule->instructions = k_malloc(count * sizeof(struct movement_instruction));
+	if (schedule->instructions == NULL && count > 0) {
+		return -ENOMEM;
 	}
-	ret = gpio_pin_configure_dt(&mouth1, GPIO_OUTPUT_INACTIVE);
-	if (ret < 0) {
-		return ret;
+
+	/* Merge the sorted per-fish tracks, adding a stop event right after
+	 * each pulse start.  A stop only has to move past the events inside
+	 * its pulse, so the insertion pass that puts it in place is close to
+	 * linear.
+	 */
+	size_t n = 0;
+	while (true) {
+		const struct movement_instruction *next = NULL;
+		size_t next_fish = 0;
+		for (size_t i = 0; i < fish_count; ++i) {
+			if (cursor[i] < tracks[i].count) {
+				const struct movement_instruction *inst = &tracks[i].instructions[cursor[i]];
+				if (next == NULL || schedule_before(inst, next)) {
+					next = inst;
+					next_fish = i;
+				}
+			}
+		}
+		if (next == NULL) {
+			break;
+		}
+		struct movement_instruction inst = *next;
+		inst.fish = next_fish;
+		n = schedule_add(schedule->instructions, n, &inst);
+		cursor[next_fish]++;
 	}
-	ret = gpio_pin_configure_dt(&body0, GPIO_OUTPUT_INACTIVE);
-	if (ret < 0) {
-		return ret;
+
+	struct movement_instruction *inst = schedule->instructions;
+	for (size_t i = 1; i < n; ++i) {
+		struct movement_instruction key = inst[i];
+		size_t j = i;
+		while (j > 0 && schedule_before(&key, &inst[j - 1])) {
+			inst[j] = inst[j - 1];
+			j--;
+		}
+		inst[j] = key;
 	}
-	ret = gpio_pin_configure_dt(&body1, GPIO_OUTPUT_INACTIVE);
-	if (ret < 0) {
-		return ret;
+
+	schedule->count = n;
+	return 0;
+}
+
+int motor_init(void)
+{
+	int ret;
+
+	for (size_t i = 0; i < ARRAY_SIZE(s_fish); ++i) {
+		const struct fish *fish = &s_fish[i];
+
+		if (!gpio_is_ready_dt(&fish->mouth0) ||
+			!gpio_is_ready_dt(&fish->mouth1) ||
+			!gpio_is_ready_dt(&fish->body0) ||
+			!gpio_is_ready_dt(&fish->body1))
+		{
+			return -1;
+		}
+
+		ret = gpio_pin_configure_dt(&fish->mouth0, GPIO_OUTPUT_INACTIVE);
+		if (ret < 0) {
+			return ret;
+		}
+		ret = gpio_pin_configure_dt(&fish->mouth1, GPIO_OUTPUT_INACTIVE);
+		if (ret < 0) {
+			return ret;
+		}
+		ret = gpio_pin_configure_dt(&fish->body0, GPIO_OUTPUT_INACTIVE);
+		if (ret < 0) {
+			return ret;
+		}
+		ret = gpio_pin_configure_dt(&fish->body1, GPIO_OUTPUT_INACTIVE);
+		if (ret < 0) {
+			return ret;
+		}
 	}
 	return 0;
 }
 
-int motor_start(sys_slist_t instructions, int64_t initial_timestamp)
+int motor_start(const struct movement_track *schedule, size_t first)
 {
 	/* Make sure we're not currently playing */
 	if (motor_busy()) {
@@ -126,12 +343,16 @@ int motor_start(sys_slist_t instructions, int64_t initial_timestamp)
 		return -EBUSY;
 	}
 
-	s_ctx.instructions = instructions;
+	s_ctx.schedule = schedule;
+	s_ctx.next = first;
+	memset(s_ctx.state, 0, sizeof(s_ctx.state));
 
 	s_ctx.cancel = false;
 	s_ctx.tid = k_thread_create(&motor_thread_data, motor_stack_area,
 			K_THREAD_STACK_SIZEOF(motor_stack_area),
-			handle_motors, NULL, NULL, NULL, 5, 0, K_NO_WAIT);
+			handle_motors, NULL, NULL, NULL,
+			CONFIG_APP_MOTOR_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(s_ctx.tid, "motors");
 
 	return 0;
 }
@@ -151,3 +372,20 @@ bool motor_busy(void)
 	}
 	return false;
 }
+
+bool motor_running(const struct movement_track *schedule)
+{
+	return motor_busy() && s_ctx.schedule == schedule;
+}
+
+void motor_get_stats(struct motor_stats *stats)
+{
+	*stats = s_ctx.stats;
+}
+
+void motor_reset_stats(void)
+{
+	s_ctx.stats.events = 0;
+	s_ctx.stats.total_late_ms = 0;
+	s_ctx.stats.max_late_ms = 0;
+}
@@ -1,14 +1,48 @@
 #ifndef __MOTOR_H__
 #define __MOTOR_H__
 
-#include <zephyr/sys/slist.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <zephyr/devicetree.h>
+
+#include "bmbbp.h"
+
+/* Number of fish wired to this controller */
+#define MOTOR_FISH_COUNT DT_NUM_INST_STATUS_OKAY(bmbb_fish)
+
+/* How long the mouth and tail motors are driven for each instruction */
+#define MOTOR_MOUTH_PULSE_MS 100
+#define MOTOR_TAIL_PULSE_MS 100
+
+struct motor_stats {
+	/* Instructions fired since the last reset */
+	uint32_t events;
+	/* How far behind the audio clock they fired */
+	int64_t total_late_ms;
+	int32_t max_late_ms;
+};
 
 int motor_init(void);
 
-int motor_start(sys_slist_t instructions, int64_t initial_timestamp);
+/* Merge the per-fish tracks into one schedule for motor_start() */
+int motor_build_schedule(const struct movement_track *tracks, size_t fish_count,
+		struct movement_track *schedule);
+
+/* Walk schedule from instruction first, with each fish set up as the ones
+ * before it would have left it.
+ */
+int motor_start(const struct movement_track *track, size_t first);
 
 void motor_cancel(void);
 
 bool motor_busy(void);
 
+/* True while the motors are walking schedule */
+bool motor_running(const struct movement_track *schedule);
+
+void motor_get_stats(struct motor_stats *stats);
+
+void motor_reset_stats(void);
+
 #endif // __MOTOR_H__
@@ -0,0 +1,203 @@
+#include <string.h>
+
+#include <zephyr/fs/fs.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "bmbbp.h"
+#include "pack.h"
+
+/* The pack is opened once at boot and stays open, so starting a track is a
+ * seek into a file that's already open rather than a walk through the FAT
+ * directories.  It is only opened again if the card has been remounted
+ * underneath it.  The tracks point straight into the index read at boot.
+ */
+
+LOG_MODULE_DECLARE(bmbb);
+
+static struct {
+	struct k_mutex lock;
+	struct fs_file_t file;
+	/* Where the file is positioned, sequential reads don't need a seek */
+	uint32_t pos;
+	struct pack_entry *entries;
+	uint16_t count;
+} s_ctx;
+
+/* Called with the lock held */
+static ssize_t read_at(uint32_t offset, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	if (offset != s_ctx.pos) {
+		ret = fs_seek(&s_ctx.file, offset, FS_SEEK_SET);
+		if (ret != 0) {
+			/* Don't know where we are any more */
+			s_ctx.pos = UINT32_MAX;
+			return ret;
+		}
+		s_ctx.pos = offset;
+	}
+	ret = fs_read(&s_ctx.file, buf, len);
+	if (ret > 0) {
+		s_ctx.pos += ret;
+	} else if (ret < 0) {
+		s_ctx.pos = UINT32_MAX;
+	}
+	return ret;
+}
+
+/* Called with the lock held */
+static int reopen(void)
+{
+	/* The old handle is already dead, whatever closing it says */
+	fs_close(&s_ctx.file);
+	fs_file_t_init(&s_ctx.file);
+	s_ctx.pos = 0;
+	int err = fs_open(&s_ctx.file, PACK_PATH, FS_O_READ);
+	if (err != 0) {
+		LOG_ERR("Failed to reopen %s: %d", PACK_PATH, err);
+		s_ctx.pos = UINT32_MAX;
+	}
+	return err;
+}
+
+ssize_t pack_read(uint32_t offset, void *buf, size_t len)
+{
+	k_mutex_lock(&s_ctx.lock, K_FOREVER);
+	ssize_t ret = read_at(offset, buf, len);
+	if (ret == -EBADF || ret == -EINVAL) {
+		/* Powering the card down and back up remounts the volume, and
+		 * FatFs rejects handles from before that as invalid objects.
+		 */
+		if (reopen() == 0) {
+			ret = read_at(offset, buf, len);
+		}
+	}
+	k_mutex_unlock(&s_ctx.lock);
+	return ret;
+}
+
+/* Most packs' index fits in this, so the header and index come in with a
+ * single read and only a bigger catalog needs a second one for the rest.
+ */
+#define INDEX_READ 2048
+
+static int read_index(uint32_t file_size)
+{
+	struct pack_header header;
+	size_t first = CLAMP(file_size, sizeof(header), INDEX_READ);
+	uint8_t *buf = k_malloc(first);
+	if (buf == NULL) {
+		LOG_ERR("Out of memory loading %s", PACK_PATH);
+		return -ENOMEM;
+	}
+
+	ssize_t len = pack_read(0, buf, first);
+	if (len < (ssize_t)sizeof(header)) {
+		LOG_ERR("Failed to read %s header: %d", PACK_PATH, len);
+		k_free(buf);
+		return len < 0 ? len : -EINVAL;
+	}
+	memcpy(&header, buf, sizeof(header));
+	if (header.magic != PACK_MAGIC || header.version != PACK_VERSION) {
+		LOG_ERR("%s is not a version %d pack", PACK_PATH, PACK_VERSION);
+		k_free(buf);
+		return -EINVAL;
+	}
+
+	size_t size = header.count * sizeof(struct pack_entry);
+	s_ctx.entries = k_malloc(size);
+	if (s_ctx.entries == NULL && size > 0) {
+		LOG_ERR("Out of memory loading %s", PACK_PATH);
+		k_free(buf);
+		return -ENOMEM;
+	}
+
+	size_t have = MIN(size, (size_t)len - sizeof(header));
+	memcpy(s_ctx.entries, buf + sizeof(header), have);
+	k_free(buf);
+
+	if (have < size) {
+		len = pack_read(sizeof(header) + have, (uint8_t *)s_ctx.entries + have, size - have);
+		if (len != (ssize_t)(size - have)) {
+			LOG_ERR("Failed to read %s index: %d", PACK_PATH, len);
+			k_free(s_ctx.entries);
+			s_ctx.entries = NULL;
+			return len < 0 ? len : -EINVAL;
+		}
+	}
+	s_ctx.count = header.count;
+	return 0;
+}
+
+static bool extent_fits(const struct pack_extent *extent, uint32_t size)
+{
+	return extent->offset <= size && extent->size <= size - extent->offset;
+}
+
+/* Everything the entry points at has to be inside the pack */
+static bool entry_fits(const struct pack_entry *entry, uint32_t size)
+{
+	if (!extent_fits(&entry->wav, size)) {
+		return false;
+	}
+	for (uint8_t i = 0; i < MIN(entry->tracks, PACK_MAX_FISH); ++i) {
+		if (!extent_fits(&entry->dat[i], size)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int pack_init(void)
+{
+	struct fs_dirent stat;
+
+	k_mutex_init(&s_ctx.lock);
+	fs_file_t_init(&s_ctx.file);
+	s_ctx.pos = 0;
+	s_ctx.count = 0;
+
+	bmbbp_recover(PACK_PATH);
+	if (fs_stat(PACK_NEW_PATH, &stat) == 0) {
+		int err = bmbbp_rename_over(PACK_NEW_PATH, PACK_PATH);
+		if (err != 0) {
+			LOG_ERR("Failed to switch to the uploaded pack: %d", err);
+		} else {
+			LOG_INF("Switched to the uploaded pack");
+		}
+	}
+	if (fs_stat(PACK_PATH, &stat) != 0) {
+		LOG_INF("No song pack at %s", PACK_PATH);
+		return -ENOENT;
+	}
+	int err = fs_open(&s_ctx.file, PACK_PATH, FS_O_READ);
+	if (err != 0) {
+		LOG_ERR("Failed to open %s: %d", PACK_PATH, err);
+		return -ENOENT;
+	}
+
+	err = read_index(stat.size);
+	if (err != 0) {
+		fs_close(&s_ctx.file);
+		return err;
+	}
+
+	int added = 0;
+	for (uint16_t i = 0; i < s_ctx.count; ++i) {
+		struct pack_entry *entry = &s_ctx.entries[i];
+
+		/* Don't trust the tool to have terminated it */
+		entry->name[PACK_NAME_MAX - 1] = '\0';
+		if (!entry_fits(entry, stat.size)) {
+			LOG_ERR("%s runs past the end of %s, skipping it", entry->name, PACK_PATH);
+			continue;
+		}
+		if (bmbbp_add_packed(entry) == 0) {
+			added++;
+		}
+	}
+	LOG_INF("Added %d of %u tracks from %s", added, s_ctx.count, PACK_PATH);
+	return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef __PACK_H__
+#define __PACK_H__
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Song pack built by tools/mkpak.py.  All little endian:
+ *
+ *   struct pack_header
+ *   struct pack_entry[count]
+ *   every script, back to back
+ *   every wav, each starting on an align boundary
+ *
+ * The wavs are stored with a plain 44 byte header in front of the samples,
+ * whatever chunks the original file had.
+ */
+#define PACK_PATH "/SD:/BMBB.PAK"
+/* Where an uploaded pack waits for the next boot, PACK_PATH is held open */
+#define PACK_NEW_PATH "/SD:/BMBB.NEW"
+#define PACK_MAGIC 0x4b415042 /* "BPAK" */
+#define PACK_VERSION 1
+
+#define PACK_NAME_MAX 32
+/* Scripts a track can carry, other fish follow the first one */
+#define PACK_MAX_FISH 4
+
+struct pack_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;
+	/* Alignment of the wavs, the cluster size the pack was built for */
+	uint32_t align;
+} __attribute__((packed));
+
+struct pack_extent {
+	uint32_t offset;
+	uint32_t size;
+} __attribute__((packed));
+
+struct pack_entry {
+	/* Where the track came from, e.g. SONGS/FISH.WAV */
+	char name[PACK_NAME_MAX];
+	/* bmbbp_mode_t */
+	uint8_t mode;
+	/* Scripts in dat[], the rest are empty */
+	uint8_t tracks;
+	uint16_t reserved;
+	struct pack_extent wav;
+	struct pack_extent dat[PACK_MAX_FISH];
+} __attribute__((packed));
+
+#if defined(CONFIG_APP_PACK)
+
+/* Open PACK_PATH and add every track in it.  Returns -ENOENT if there is no
+ * pack, in which case the songs should be found on the card as usual.
+ */
+int pack_init(void);
+
+/* Read len bytes from offset in the pack */
+ssize_t pack_read(uint32_t offset, void *buf, size_t len);
+
+#else
+
+static inline int pack_init(void)
+{
+	return -ENOENT;
+}
+
+static inline ssize_t pack_read(uint32_t offset, void *buf, size_t len)
+{
+	return -ENOTSUP;
+}
+
+#endif
+
+#endif // __PACK_H__
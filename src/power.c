@@ -0,0 +1,157 @@
+#include <string.h>
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/storage/disk_access.h>
+
+#include "power.h"
+
+/* Powers the SD card down while nothing is using it.  Everything that reads
+ * from the card holds a reference while it has files open (FatFs won't
+ * touch a file across a de-init), and the card is de-initialized once the
+ * last reference has been idle for CONFIG_APP_DISK_IDLE_MS.  FatFs notices
+ * the card is uninitialized and brings it back on its own if something else
+ * like the fs shell gets to it first.
+ *
+ * If bringing the card back ever takes longer than
+ * CONFIG_APP_RESUME_LATENCY_MAX_MS, suspending is turned off so the time to
+ * the first sample doesn't suffer.
+ *
+ * The work runs on its own queue, since bringing the card up blocks on the
+ * bus for a while.  The queue is started from SYS_INIT and everything else
+ * is statically initialized, so the button and shell can call in before
+ * power_init() has run; nothing is suspended until it has.
+ */
+
+#define DISK_DRIVE_NAME "SD"
+#define DISK_MOUNT_PT "/"DISK_DRIVE_NAME":"
+
+#define POWER_STACK_SIZE 1024
+K_THREAD_STACK_DEFINE(power_stack_area, POWER_STACK_SIZE);
+
+LOG_MODULE_DECLARE(bmbb);
+
+static void suspend_handler(struct k_work *work);
+static void prepare_handler(struct k_work *work);
+
+K_MUTEX_DEFINE(power_lock);
+K_WORK_DELAYABLE_DEFINE(disk_suspend, suspend_handler);
+K_WORK_DEFINE(disk_prepare, prepare_handler);
+
+static struct {
+	struct k_work_q queue;
+	/* Set by power_init() once the card has been mounted */
+	bool ready;
+	uint32_t refs;
+	bool suspended;
+	struct power_stats stats;
+} s_ctx;
+
+static void suspend_handler(struct k_work *work)
+{
+	k_mutex_lock(&power_lock, K_FOREVER);
+	if (s_ctx.ready && s_ctx.refs == 0 && !s_ctx.suspended &&
+		!s_ctx.stats.disk_suspend_disabled) {
+		int err = disk_access_ioctl(DISK_DRIVE_NAME, DISK_IOCTL_CTRL_DEINIT, NULL);
+		if (err == 0) {
+			s_ctx.suspended = true;
+			s_ctx.stats.disk_suspends++;
+		} else {
+			LOG_WRN("Failed to suspend disk: %d", err);
+		}
+	}
+	k_mutex_unlock(&power_lock);
+}
+
+/* Called with the lock held */
+static void resume(void)
+{
+	if (!s_ctx.suspended) {
+		return;
+	}
+
+	int64_t start = k_uptime_get();
+	int err = disk_access_ioctl(DISK_DRIVE_NAME, DISK_IOCTL_CTRL_INIT, NULL);
+	uint32_t latency = k_uptime_get() - start;
+	if (err != 0) {
+		LOG_ERR("Failed to resume disk: %d", err);
+		return;
+	}
+
+	s_ctx.suspended = false;
+	s_ctx.stats.disk_resumes++;
+	s_ctx.stats.disk_resume_last_ms = latency;
+	s_ctx.stats.disk_resume_max_ms = MAX(s_ctx.stats.disk_resume_max_ms, latency);
+	if (latency > CONFIG_APP_RESUME_LATENCY_MAX_MS) {
+		LOG_WRN("Disk took %u ms to resume, leaving it powered", latency);
+		s_ctx.stats.disk_suspend_disabled = true;
+	}
+}
+
+static void prepare_handler(struct k_work *work)
+{
+	if (power_disk_get(DISK_MOUNT_PT)) {
+		power_disk_put();
+	}
+}
+
+static int power_queue_init(void)
+{
+	k_work_queue_init(&s_ctx.queue);
+	k_work_queue_start(&s_ctx.queue, power_stack_area,
+			K_THREAD_STACK_SIZEOF(power_stack_area),
+			CONFIG_APP_DISK_POWER_PRIORITY, NULL);
+	k_thread_name_set(k_work_queue_thread_get(&s_ctx.queue), "disk_power");
+	return 0;
+}
+
+SYS_INIT(power_queue_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+int power_init(void)
+{
+	k_mutex_lock(&power_lock, K_FOREVER);
+	s_ctx.ready = true;
+	/* The card is up from mounting, let it go once the songs are loaded */
+	if (s_ctx.refs == 0) {
+		k_work_reschedule_for_queue(&s_ctx.queue, &disk_suspend,
+				K_MSEC(CONFIG_APP_DISK_IDLE_MS));
+	}
+	k_mutex_unlock(&power_lock);
+	return 0;
+}
+
+bool power_disk_get(const char *path)
+{
+	if (strncmp(path, DISK_MOUNT_PT, strlen(DISK_MOUNT_PT)) != 0) {
+		return false;
+	}
+
+	k_mutex_lock(&power_lock, K_FOREVER);
+	s_ctx.refs++;
+	k_work_cancel_delayable(&disk_suspend);
+	resume();
+	k_mutex_unlock(&power_lock);
+	return true;
+}
+
+void power_disk_put(void)
+{
+	k_mutex_lock(&power_lock, K_FOREVER);
+	if (s_ctx.refs > 0 && --s_ctx.refs == 0) {
+		k_work_reschedule_for_queue(&s_ctx.queue, &disk_suspend,
+				K_MSEC(CONFIG_APP_DISK_IDLE_MS));
+	}
+	k_mutex_unlock(&power_lock);
+}
+
+void power_disk_prepare(void)
+{
+	k_work_submit_to_queue(&s_ctx.queue, &disk_prepare);
+}
+
+void power_get_stats(struct power_stats *stats)
+{
+	k_mutex_lock(&power_lock, K_FOREVER);
+	*stats = s_ctx.stats;
+	k_mutex_unlock(&power_lock);
+}
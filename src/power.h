@@ -0,0 +1,61 @@
+#ifndef __POWER_H__
+#define __POWER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct power_stats {
+	uint32_t disk_suspends;
+	uint32_t disk_resumes;
+	uint32_t disk_resume_last_ms;
+	uint32_t disk_resume_max_ms;
+	/* Set once a resume went over CONFIG_APP_RESUME_LATENCY_MAX_MS */
+	bool disk_suspend_disabled;
+};
+
+#if defined(CONFIG_APP_DISK_SUSPEND)
+
+int power_init(void);
+
+/* Take a reference on the SD card if path is on it, resuming the card if it
+ * was suspended.  Returns true if a reference was taken, which must be
+ * dropped with power_disk_put().
+ */
+bool power_disk_get(const char *path);
+
+/* Drop a reference, the card is suspended after CONFIG_APP_DISK_IDLE_MS */
+void power_disk_put(void);
+
+/* Start resuming the card in the background ahead of a play */
+void power_disk_prepare(void);
+
+void power_get_stats(struct power_stats *stats);
+
+#else
+
+static inline int power_init(void)
+{
+	return 0;
+}
+
+static inline bool power_disk_get(const char *path)
+{
+	return false;
+}
+
+static inline void power_disk_put(void)
+{
+}
+
+static inline void power_disk_prepare(void)
+{
+}
+
+static inline void power_get_stats(struct power_stats *stats)
+{
+	*stats = (struct power_stats){ 0 };
+}
+
+#endif
+
+#endif // __POWER_H__
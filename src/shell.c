@@ -1,8 +1,17 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <zephyr/drivers/retained_mem.h>
+#include <zephyr/fs/fs.h>
 #include <zephyr/shell/shell.h>
 #include <zephyr/sys/reboot.h>
 
+#include "audio.h"
 #include "bmbbp.h"
+#include "cache.h"
+#include "motor.h"
+#include "power.h"
+#include "upload.h"
 
 /* For the UF2 bootloader, we can trigger DFU mode by 
  * writing magic value 0x57 to GPREGRET register and then rebooting.
@@ -52,6 +61,9 @@ static int bmbb_next_handler(const struct shell *sh, size_t argc, char **argv)
 	ARG_UNUSED(argc);
 	ARG_UNUSED(argv);
 
+	/* A play usually follows, get the card going */
+	power_disk_prepare();
+
 	const char *wav = bmbbp_next_song();
 	shell_print(sh, "Next song is now %s", wav);
 	return 0;
@@ -67,17 +79,270 @@ static int bmbb_play_handler(const struct shell *sh, size_t argc, char **argv)
 	return 0;
 }
 
+static int bmbb_seek_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	char *end;
+	unsigned long offset_ms = strtoul(argv[1], &end, 10);
+	if (*end != '\0' || end == argv[1] || offset_ms > INT32_MAX) {
+		shell_error(sh, "Invalid offset %s", argv[1]);
+		return -EINVAL;
+	}
+
+	bmbbp_cancel_current_song();
+	const char *wav = bmbbp_start_playing_at(offset_ms);
+	shell_print(sh, "Now playing %s from %lu ms", wav, offset_ms);
+	return 0;
+}
+
+static int bmbb_resume_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	const char *wav = bmbbp_resume_playing();
+	shell_print(sh, "Resumed %s", wav);
+	return 0;
+}
+
 static int bmbb_mode_handler(const struct shell *sh, size_t argc, char **argv)
 {
 	bmbbp_toggle_mode();
 	return 0;
 }
 
+static int bmbb_effect_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	int32_t gain = AUDIO_GAIN_UNITY;
+
+	if (argc > 2) {
+		/* Volume is given as a percentage */
+		char *end;
+		long volume = strtol(argv[2], &end, 10);
+		if (end == argv[2] || *end != '\0' || volume < 0 || volume > 100) {
+			shell_error(sh, "Invalid volume %s, must be 0-100", argv[2]);
+			return -EINVAL;
+		}
+		gain = volume * AUDIO_GAIN_UNITY / 100;
+	}
+
+	int err = audio_play_effect(argv[1], gain);
+	if (err != 0) {
+		shell_error(sh, "Failed to play effect %s: %d", argv[1], err);
+		return err;
+	}
+	shell_print(sh, "Playing effect %s", argv[1]);
+	return 0;
+}
+
+static int bmbb_stats_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	struct audio_stats stats;
+	struct motor_stats mstats;
+
+	audio_get_stats(&stats);
+	shell_print(sh, "Near underruns: %u", stats.near_underruns);
+	shell_print(sh, "Underruns: %u", stats.underruns);
+	shell_print(sh, "Lowest I2S queue depth: %d", stats.min_queued);
+
+	motor_get_stats(&mstats);
+	shell_print(sh, "Motor events: %u across %d fish", mstats.events, MOTOR_FISH_COUNT);
+	if (mstats.events > 0) {
+		shell_print(sh, "Motor lateness: avg %lld ms, max %d ms",
+			mstats.total_late_ms / mstats.events, mstats.max_late_ms);
+	}
+
+	struct power_stats pstats;
+	power_get_stats(&pstats);
+	shell_print(sh, "I2S resume: last %u us, max %u us, bound %u ms%s",
+		stats.i2s_resume_last_us, stats.i2s_resume_max_us, CONFIG_APP_RESUME_LATENCY_MAX_MS,
+		stats.i2s_suspend_disabled ? ", suspend disabled" : "");
+	shell_print(sh, "Disk suspends: %u, resumes: %u (last %u ms, max %u ms)%s",
+		pstats.disk_suspends, pstats.disk_resumes, pstats.disk_resume_last_ms,
+		pstats.disk_resume_max_ms,
+		pstats.disk_suspend_disabled ? ", suspend disabled" : "");
+
+	if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+		audio_reset_stats();
+		motor_reset_stats();
+	}
+	return 0;
+}
+
+static void print_cache_entry(const char *path, uint32_t plays, bool cached, void *user_data)
+{
+	const struct shell *sh = user_data;
+
+	shell_print(sh, "%-40s %5u plays %s", path, plays, cached ? "cached" : "");
+}
+
+static int bmbb_cache_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	cache_foreach(print_cache_entry, (void *)sh);
+	return 0;
+}
+
+/* Read a whole file in playback sized blocks */
+static int bench_read(const struct shell *sh, const char *tier, const char *path)
+{
+	static uint8_t buf[AUDIO_BLOCK_SIZE] __aligned(4);
+	struct fs_file_t file;
+	size_t total = 0;
+	ssize_t len;
+
+	fs_file_t_init(&file);
+	int err = fs_open(&file, path, FS_O_READ);
+	if (err != 0) {
+		shell_error(sh, "Failed to open %s: %d", path, err);
+		return err;
+	}
+
+	uint32_t start = k_cycle_get_32();
+	while ((len = fs_read(&file, buf, sizeof(buf))) > 0) {
+		total += len;
+	}
+	uint32_t elapsed_us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+	fs_close(&file);
+
+	if (len < 0) {
+		shell_error(sh, "Read of %s failed: %d", path, len);
+		return len;
+	}
+	shell_print(sh, "%s: read %u bytes in %u us (%llu KiB/s)", tier, total, elapsed_us,
+		elapsed_us > 0 ? (uint64_t)total * USEC_PER_SEC / 1024 / elapsed_us : 0);
+	return 0;
+}
+
+/* Read a file from the SD card and from the cache, if it's there, the way
+ * playback does to compare the storage tiers
+ */
+static int bmbb_bench_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	char name[CACHE_PATH_MAX];
+
+	bool disk_ref = power_disk_get(argv[1]);
+	int err = bench_read(sh, "SD", argv[1]);
+	if (disk_ref) {
+		power_disk_put();
+	}
+
+	const char *cached = cache_resolve(argv[1], name, sizeof(name));
+	if (err == 0 && cached != argv[1]) {
+		err = bench_read(sh, "Cache", cached);
+	}
+	return err;
+}
+
+#define DATBENCH_PATH "/SD:/BENCH.DAT"
+
+static int write_bench_dat(unsigned long lines)
+{
+	struct fs_file_t file;
+	char buf[32 * 8];
+	size_t len = 0;
+	int err = 0;
+
+	fs_file_t_init(&file);
+	err = fs_open(&file, DATBENCH_PATH, FS_O_WRITE | FS_O_CREATE | FS_O_TRUNC);
+	if (err != 0) {
+		return err;
+	}
+	for (unsigned long i = 0; i < lines && err == 0; ++i) {
+		/* Fixed 8 byte lines so the old reader can take them too */
+		len += snprintf(&buf[len], sizeof(buf) - len, "%c%06lu\n", "MTMH"[i % 4],
+			(i * 50) % 1000000);
+		if (len == sizeof(buf) || i == lines - 1) {
+			ssize_t written = fs_write(&file, buf, len);
+			if (written != len) {
+				err = written < 0 ? written : -ENOSPC;
+			}
+			len = 0;
+		}
+	}
+	fs_close(&file);
+	return err;
+}
+
+/* Compare the streaming .dat parser with the per-line reader it replaced */
+static int bmbb_datbench_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	struct bmbbp_parse_bench bench;
+	unsigned long lines = 10000;
+	char *end;
+
+	if (argc > 1) {
+		lines = strtoul(argv[1], &end, 10);
+		if (*end != '\0' || end == argv[1] || lines == 0) {
+			shell_error(sh, "Invalid line count %s", argv[1]);
+			return -EINVAL;
+		}
+	}
+
+	bool disk_ref = power_disk_get(DATBENCH_PATH);
+	int err = write_bench_dat(lines);
+	if (err == 0) {
+		err = bmbbp_bench_parse(DATBENCH_PATH, &bench);
+	}
+	fs_unlink(DATBENCH_PATH);
+	if (disk_ref) {
+		power_disk_put();
+	}
+	if (err != 0) {
+		shell_error(sh, "Benchmark failed: %d", err);
+		return err;
+	}
+
+	shell_print(sh, "%u lines: per-line fs_read %u us, streaming %u us", bench.lines,
+		bench.per_line_us, bench.streaming_us);
+	if (bench.streaming_us > 0) {
+		shell_print(sh, "Speedup %u.%02ux", bench.per_line_us / bench.streaming_us,
+			bench.per_line_us % bench.streaming_us * 100 / bench.streaming_us);
+	}
+	return 0;
+}
+
+/* Hands the UART to the upload protocol, see src/upload.c */
+static int bmbb_upload_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	char *end;
+	uint32_t size = strtoul(argv[2], &end, 0);
+	if (*end != '\0' || end == argv[2]) {
+		shell_error(sh, "Invalid size %s", argv[2]);
+		return -EINVAL;
+	}
+	uint32_t crc = strtoul(argv[3], &end, 0);
+	if (*end != '\0' || end == argv[3]) {
+		shell_error(sh, "Invalid crc32 %s", argv[3]);
+		return -EINVAL;
+	}
+
+	int err = upload_start(sh, argv[1], size, crc);
+	if (err != 0) {
+		shell_error(sh, "@E %d", err);
+	}
+	return err;
+}
+
 SHELL_STATIC_SUBCMD_SET_CREATE(sub_bmbb,
 		SHELL_CMD(cancel, NULL, "Cancel current audio", bmbb_cancel_handler),
 		SHELL_CMD(next, NULL, "Set to next audio", bmbb_next_handler),
 		SHELL_CMD(play, NULL, "Play current audio", bmbb_play_handler),
 		SHELL_CMD(mode, NULL, "Toggle songs/jokes mode", bmbb_mode_handler),
+		SHELL_CMD_ARG(seek, NULL, "Play current audio from <ms>", bmbb_seek_handler, 2, 0),
+		SHELL_CMD(resume, NULL, "Resume cancelled audio", bmbb_resume_handler),
+		SHELL_CMD_ARG(effect, NULL, "Mix a wav over the current audio: <file> [volume%]",
+			bmbb_effect_handler, 2, 1),
+		SHELL_CMD(cache, NULL, "List cached files and play counts", bmbb_cache_handler),
+		SHELL_CMD_ARG(bench, NULL, "Measure read throughput of <file> from each tier",
+			bmbb_bench_handler, 2, 0),
+		SHELL_CMD_ARG(datbench, NULL, "Time the .dat parser on a generated script: [lines]",
+			bmbb_datbench_handler, 1, 1),
+		SHELL_CMD_ARG(stats, NULL, "Show audio underrun and motor jitter stats: [reset]",
+			bmbb_stats_handler, 1, 1),
+		SHELL_CMD_ARG(upload, NULL, "Receive <path> <size> <crc32> with tools/bmbb_upload.py",
+			bmbb_upload_handler, 4, 0),
 		SHELL_SUBCMD_SET_END
 );
 
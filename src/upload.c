@@ -0,0 +1,444 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <zephyr/fs/fs.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+
+#include "audio.h"
+#include "bmbbp.h"
+#include "cache.h"
+#include "motor.h"
+#include "pack.h"
+#include "power.h"
+#include "upload.h"
+
+/* Binary file upload over the shell's UART.  `bmbb upload <path> <size>
+ * <crc32>` answers "@R <window> <chunk>" and takes the UART over from the
+ * shell.  The host then sends frames of
+ *
+ *   0xb5, type, seq (u16), len (u16), payload, crc32 of type..payload
+ *
+ * all little endian, with up to <window> DATA frames of at most <chunk>
+ * bytes in flight.  Each good frame in sequence is acked with "@A <seq>".
+ * A bad or out of order frame gets a single "@N <seq>" naming the frame
+ * expected next, and everything else is dropped until that one turns up
+ * (go-back-N).  END gets "@D" or "@E <err>" and the shell is back.
+ *
+ * Data goes into a temporary file in aligned UPLOAD_WRITE_SIZE pieces, which
+ * only replaces path once its size and crc32 check out, see
+ * bmbbp_rename_over() for how a power cut can't lose both.  A file that's open
+ * isn't replaced: the wav that's playing is refused with -EBUSY, and a new
+ * song pack is kept as PACK_NEW_PATH until the next boot.
+ * tools/bmbb_upload.py is the sender.
+ */
+
+#define UPLOAD_SOF 0xb5
+#define UPLOAD_CHUNK 1024
+#define FRAME_HEADER_SIZE 5
+
+#define FRAME_DATA 'D'
+#define FRAME_END 'E'
+#define FRAME_ABORT 'A'
+
+#define UPLOAD_WRITE_SIZE 4096
+/* Give the shell back if the host goes quiet */
+#define UPLOAD_TIMEOUT K_SECONDS(5)
+
+/* Frames in flight have to fit in the UART's receive buffer while a write to
+ * the card holds up the shell thread.
+ */
+#if defined(CONFIG_SHELL_BACKEND_SERIAL_RX_RING_BUFFER_SIZE)
+#define UPLOAD_WINDOW MAX(1, CONFIG_SHELL_BACKEND_SERIAL_RX_RING_BUFFER_SIZE / \
+	(UPLOAD_CHUNK + FRAME_HEADER_SIZE + 5))
+#else
+#define UPLOAD_WINDOW 1
+#endif
+
+#define DISK_MOUNT_PT "/SD:"
+#define SONGS_DIR DISK_MOUNT_PT"/SONGS/"
+#define JOKES_DIR DISK_MOUNT_PT"/JOKES/"
+
+LOG_MODULE_DECLARE(bmbb);
+
+enum parse_state {
+	PARSE_SOF,
+	PARSE_HEADER,
+	PARSE_PAYLOAD,
+	PARSE_CRC,
+};
+
+static void timeout_handler(struct k_work *work);
+
+K_MUTEX_DEFINE(upload_lock);
+K_WORK_DELAYABLE_DEFINE(upload_timeout, timeout_handler);
+
+static struct {
+	const struct shell *sh;
+	bool active;
+	bool disk_ref;
+	struct fs_file_t file;
+	char path[CACHE_PATH_MAX];
+	char tmp[CACHE_PATH_MAX];
+	uint32_t size;
+	uint32_t crc;
+	uint32_t received;
+	uint32_t received_crc;
+	size_t buffered;
+	uint16_t expected;
+	/* Only ask for a resend once per gap */
+	bool nacked;
+
+	/* The frame coming in */
+	enum parse_state state;
+	size_t got;
+	uint8_t header[FRAME_HEADER_SIZE];
+	uint16_t len;
+	uint8_t frame_crc[sizeof(uint32_t)];
+} s_ctx;
+
+static uint8_t s_payload[UPLOAD_CHUNK];
+static uint8_t s_write_buf[UPLOAD_WRITE_SIZE] __aligned(4);
+
+static int flush(void)
+{
+	ssize_t written = fs_write(&s_ctx.file, s_write_buf, s_ctx.buffered);
+	if (written != s_ctx.buffered) {
+		return written < 0 ? written : -ENOSPC;
+	}
+	s_ctx.buffered = 0;
+	return 0;
+}
+
+/* Only the changed song is reloaded, not the whole card */
+static void refresh_catalog(const char *path)
+{
+	char wav[CACHE_PATH_MAX];
+	char dat[CACHE_PATH_MAX];
+	struct fs_dirent entry;
+	bmbbp_mode_t mode;
+
+	if (strncasecmp(path, SONGS_DIR, strlen(SONGS_DIR)) == 0) {
+		mode = SONGS;
+	} else if (strncasecmp(path, JOKES_DIR, strlen(JOKES_DIR)) == 0) {
+		mode = JOKES;
+	} else {
+		return;
+	}
+
+	/* SONG.WAV, SONG.DAT and SONG.1.DAT all belong to SONG.WAV */
+	const char *name = strrchr(path, '/') + 1;
+	const char *dot = strchr(name, '.');
+	if (dot == NULL) {
+		return;
+	}
+	int base = dot - path;
+	snprintf(wav, sizeof(wav), "%.*s.WAV", base, path);
+	snprintf(dat, sizeof(dat), "%.*s.DAT", base, path);
+	if (fs_stat(wav, &entry) != 0 || fs_stat(dat, &entry) != 0) {
+		/* Waiting on the other half */
+		return;
+	}
+
+	int err = bmbbp_refresh(mode, wav, dat);
+	if (err != 0) {
+		LOG_ERR("Failed to refresh %s: %d", wav, err);
+	}
+}
+
+/* Move the finished upload into place without pulling a file out from under
+ * whoever has it open
+ */
+static int replace(const char *tmp, const char *path)
+{
+	if (IS_ENABLED(CONFIG_APP_PACK) && strcasecmp(path, PACK_PATH) == 0) {
+		int err = bmbbp_rename_over(tmp, PACK_NEW_PATH);
+		if (err == 0) {
+			LOG_INF("New %s takes over after a reboot", PACK_PATH);
+		}
+		return err;
+	}
+	return bmbbp_replace(tmp, path);
+}
+
+/* Called with the lock held */
+static void finish(int err)
+{
+	if (err == 0 && s_ctx.buffered > 0) {
+		err = flush();
+	}
+	fs_close(&s_ctx.file);
+
+	if (err == 0 && s_ctx.received != s_ctx.size) {
+		err = -EMSGSIZE;
+	}
+	if (err == 0 && s_ctx.received_crc != s_ctx.crc) {
+		err = -EBADMSG;
+	}
+	if (err == 0) {
+		err = replace(s_ctx.tmp, s_ctx.path);
+	}
+	if (err == 0) {
+		cache_invalidate(s_ctx.path);
+		refresh_catalog(s_ctx.path);
+	} else {
+		fs_unlink(s_ctx.tmp);
+	}
+
+	if (s_ctx.disk_ref) {
+		power_disk_put();
+		s_ctx.disk_ref = false;
+	}
+	s_ctx.active = false;
+	k_work_cancel_delayable(&upload_timeout);
+	shell_set_bypass(s_ctx.sh, NULL, NULL);
+
+	if (err == 0) {
+		LOG_INF("Received %s (%u bytes)", s_ctx.path, s_ctx.received);
+		shell_fprintf(s_ctx.sh, SHELL_NORMAL, "@D\n");
+	} else {
+		LOG_ERR("Upload of %s failed: %d", s_ctx.path, err);
+		shell_fprintf(s_ctx.sh, SHELL_NORMAL, "@E %d\n", err);
+	}
+}
+
+static void nack(void)
+{
+	if (!s_ctx.nacked) {
+		shell_fprintf(s_ctx.sh, SHELL_NORMAL, "@N %04x\n", s_ctx.expected);
+		s_ctx.nacked = true;
+	}
+}
+
+static void handle_frame(void)
+{
+	uint8_t type = s_ctx.header[0];
+	uint16_t seq = sys_get_le16(&s_ctx.header[1]);
+
+	uint32_t crc = crc32_ieee(s_ctx.header, sizeof(s_ctx.header));
+	crc = crc32_ieee_update(crc, s_payload, s_ctx.len);
+	if (crc != sys_get_le32(s_ctx.frame_crc)) {
+		nack();
+		return;
+	}
+
+	if (type == FRAME_ABORT) {
+		finish(-ECANCELED);
+		return;
+	}
+	if (seq != s_ctx.expected) {
+		if ((uint16_t)(s_ctx.expected - seq) <= UPLOAD_WINDOW) {
+			/* A resend of something we already have, the ack got lost */
+			shell_fprintf(s_ctx.sh, SHELL_NORMAL, "@A %04x\n",
+				(uint16_t)(s_ctx.expected - 1));
+		} else {
+			nack();
+		}
+		return;
+	}
+	s_ctx.nacked = false;
+
+	if (type == FRAME_END) {
+		finish(0);
+		return;
+	}
+	if (type != FRAME_DATA || s_ctx.received + s_ctx.len > s_ctx.size) {
+		finish(-EINVAL);
+		return;
+	}
+
+	/* Collect whole write buffers so the card sees aligned writes */
+	size_t done = 0;
+	while (done < s_ctx.len) {
+		size_t n = MIN(s_ctx.len - done, sizeof(s_write_buf) - s_ctx.buffered);
+		memcpy(&s_write_buf[s_ctx.buffered], &s_payload[done], n);
+		s_ctx.buffered += n;
+		done += n;
+		if (s_ctx.buffered == sizeof(s_write_buf)) {
+			int err = flush();
+			if (err != 0) {
+				finish(err);
+				return;
+			}
+		}
+	}
+	s_ctx.received_crc = crc32_ieee_update(s_ctx.received_crc, s_payload, s_ctx.len);
+	s_ctx.received += s_ctx.len;
+	s_ctx.expected++;
+	shell_fprintf(s_ctx.sh, SHELL_NORMAL, "@A %04x\n", seq);
+}
+
+static void bypass_cb(const struct shell *sh, uint8_t *data, size_t len, void *user_data)
+{
+	ARG_UNUSED(sh);
+	ARG_UNUSED(user_data);
+
+	k_mutex_lock(&upload_lock, K_FOREVER);
+	k_work_reschedule(&upload_timeout, UPLOAD_TIMEOUT);
+
+	size_t i = 0;
+	while (i < len && s_ctx.active) {
+		switch (s_ctx.state) {
+		case PARSE_SOF:
+			if (data[i++] == UPLOAD_SOF) {
+				s_ctx.state = PARSE_HEADER;
+				s_ctx.got = 0;
+			}
+			break;
+		case PARSE_HEADER:
+			s_ctx.header[s_ctx.got++] = data[i++];
+			if (s_ctx.got == sizeof(s_ctx.header)) {
+				s_ctx.len = sys_get_le16(&s_ctx.header[3]);
+				s_ctx.got = 0;
+				if (s_ctx.len > UPLOAD_CHUNK) {
+					/* Not a real frame, look for the next one */
+					nack();
+					s_ctx.state = PARSE_SOF;
+				} else {
+					s_ctx.state = s_ctx.len > 0 ? PARSE_PAYLOAD : PARSE_CRC;
+				}
+			}
+			break;
+		case PARSE_PAYLOAD: {
+			size_t n = MIN(len - i, s_ctx.len - s_ctx.got);
+			memcpy(&s_payload[s_ctx.got], &data[i], n);
+			s_ctx.got += n;
+			i += n;
+			if (s_ctx.got == s_ctx.len) {
+				s_ctx.state = PARSE_CRC;
+				s_ctx.got = 0;
+			}
+			break;
+		}
+		case PARSE_CRC:
+			s_ctx.frame_crc[s_ctx.got++] = data[i++];
+			if (s_ctx.got == sizeof(s_ctx.frame_crc)) {
+				s_ctx.state = PARSE_SOF;
+				handle_frame();
+			}
+			break;
+		}
+	}
+	k_mutex_unlock(&upload_lock);
+}
+
+static void timeout_handler(struct k_work *work)
+{
+	k_mutex_lock(&upload_lock, K_FOREVER);
+	if (s_ctx.active) {
+		finish(-ETIMEDOUT);
+	}
+	k_mutex_unlock(&upload_lock);
+}
+
+/* Only files on the SD card, and nothing that climbs back out of it.  FatFs
+ * takes a backslash as a separator too.
+ */
+static bool path_allowed(const char *path)
+{
+	size_t mount = strlen(DISK_MOUNT_PT);
+
+	if (strncmp(path, DISK_MOUNT_PT, mount) != 0 || path[mount] != '/') {
+		return false;
+	}
+
+	const char *name = &path[mount + 1];
+	while (true) {
+		size_t len = strcspn(name, "/\\");
+		if (len == 0 || (len == 2 && strncmp(name, "..", 2) == 0)) {
+			/* An empty name or a parent */
+			return false;
+		}
+		if (name[len] == '\0') {
+			return true;
+		}
+		name += len + 1;
+	}
+}
+
+/* The old file stays until the new one has replaced it, so the whole of the
+ * new one has to fit beside it
+ */
+static int check_space(uint32_t size)
+{
+	struct fs_statvfs stat;
+
+	int err = fs_statvfs(DISK_MOUNT_PT, &stat);
+	if (err != 0) {
+		return err;
+	}
+	if ((uint64_t)stat.f_bfree * stat.f_frsize < size) {
+		LOG_ERR("No room for %u bytes on %s", size, DISK_MOUNT_PT);
+		return -ENOSPC;
+	}
+	return 0;
+}
+
+int upload_start(const struct shell *sh, const char *path, uint32_t size, uint32_t crc)
+{
+	int n;
+	int err = 0;
+
+	k_mutex_lock(&upload_lock, K_FOREVER);
+	if (s_ctx.active) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	if (path[0] == '/') {
+		n = snprintf(s_ctx.path, sizeof(s_ctx.path), "%s", path);
+	} else {
+		n = snprintf(s_ctx.path, sizeof(s_ctx.path), DISK_MOUNT_PT"/%s", path);
+	}
+	if (n < 0 || n >= sizeof(s_ctx.path) ||
+		snprintf(s_ctx.tmp, sizeof(s_ctx.tmp), "%s.TMP", s_ctx.path) >= sizeof(s_ctx.tmp)) {
+		err = -ENAMETOOLONG;
+		goto out;
+	}
+	if (!path_allowed(s_ctx.path)) {
+		err = -EACCES;
+		goto out;
+	}
+
+	/* Leave the card and the CPU to the upload, effects and a song the
+	 * list has moved on from included
+	 */
+	bmbbp_cancel_current_song();
+	audio_cancel();
+	motor_cancel();
+
+	s_ctx.disk_ref = power_disk_get(s_ctx.path);
+	err = check_space(size);
+	if (err == 0) {
+		fs_file_t_init(&s_ctx.file);
+		err = fs_open(&s_ctx.file, s_ctx.tmp, FS_O_WRITE | FS_O_CREATE | FS_O_TRUNC);
+	}
+	if (err != 0) {
+		if (s_ctx.disk_ref) {
+			power_disk_put();
+			s_ctx.disk_ref = false;
+		}
+		goto out;
+	}
+
+	s_ctx.sh = sh;
+	s_ctx.size = size;
+	s_ctx.crc = crc;
+	s_ctx.received = 0;
+	s_ctx.received_crc = 0;
+	s_ctx.buffered = 0;
+	s_ctx.expected = 0;
+	s_ctx.nacked = false;
+	s_ctx.state = PARSE_SOF;
+	s_ctx.active = true;
+
+	shell_fprintf(sh, SHELL_NORMAL, "@R %u %u\n", UPLOAD_WINDOW, UPLOAD_CHUNK);
+	shell_set_bypass(sh, bypass_cb, NULL);
+	k_work_reschedule(&upload_timeout, UPLOAD_TIMEOUT);
+out:
+	k_mutex_unlock(&upload_lock);
+	return err;
+}
@@ -0,0 +1,26 @@
+#ifndef __UPLOAD_H__
+#define __UPLOAD_H__
+
+#include <errno.h>
+#include <stdint.h>
+#include <zephyr/shell/shell.h>
+
+#if defined(CONFIG_APP_UPLOAD)
+
+/* Switch the shell's UART over to the binary upload protocol to receive
+ * size bytes with the given crc32 into path, which has to be on the SD card.
+ * The shell comes back once the transfer ends, fails or goes quiet.
+ */
+int upload_start(const struct shell *sh, const char *path, uint32_t size, uint32_t crc);
+
+#else
+
+static inline int upload_start(const struct shell *sh, const char *path, uint32_t size,
+		uint32_t crc)
+{
+	return -ENOTSUP;
+}
+
+#endif
+
+#endif // __UPLOAD_H__
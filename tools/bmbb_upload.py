@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""Send a file to the fish's SD card over the shell UART.
+
+    bmbb_upload.py PORT LOCAL REMOTE [--baud 115200]
+
+REMOTE is relative to the card, e.g. SONGS/FISH.WAV.  Needs pyserial.  See
+src/upload.c for the protocol.
+"""
+
+import argparse
+import re
+import struct
+import sys
+import time
+import zlib
+
+import serial
+
+SOF = 0xB5
+FRAME_DATA = ord("D")
+FRAME_END = ord("E")
+FRAME_ABORT = ord("A")
+
+REPLY = re.compile(rb"@([ARNDE])(?: (-?[0-9a-fA-F]+))?(?: ([0-9]+))?")
+
+# Bits on the wire per byte with 8N1
+BITS_PER_BYTE = 10
+
+
+def frame(kind, seq, payload=b""):
+    body = struct.pack("<BHH", kind, seq & 0xFFFF, len(payload)) + payload
+    return bytes([SOF]) + body + struct.pack("<I", zlib.crc32(body))
+
+
+class Link:
+    def __init__(self, port):
+        self.port = port
+        self.pending = b""
+
+    def reply(self, timeout):
+        """Next @ reply from the fish, skipping prompts and log lines."""
+        deadline = time.monotonic() + timeout
+        while True:
+            match = REPLY.search(self.pending)
+            if match and self.pending.find(b"\n", match.end()) >= 0:
+                self.pending = self.pending[match.end():]
+                return match.group(1).decode(), match.group(2), match.group(3)
+            if time.monotonic() > deadline:
+                return None
+            self.pending += self.port.read(self.port.in_waiting or 1)
+
+
+def unwrap(seq, base):
+    """Absolute frame number of a 16 bit seq near base."""
+    return base + ((seq - base) & 0xFFFF) - (0x10000 if (seq - base) & 0x8000 else 0)
+
+
+def upload(port, data, remote, baud):
+    link = Link(port)
+    port.reset_input_buffer()
+    port.write(b"\r\nbmbb upload %s %d 0x%08x\r\n" % (remote.encode(), len(data),
+                                                      zlib.crc32(data)))
+    ready = link.reply(5.0)
+    if ready is None or ready[0] != "R":
+        sys.exit("fish didn't start the upload: %r" % (ready,))
+    window, chunk = int(ready[1]), int(ready[2])
+    # Long enough for a full window to go out and be acked, with room for
+    # the card to stall on a write
+    timeout = max(0.25, 3 * window * (chunk + 10) * BITS_PER_BYTE / baud)
+
+    frames = [frame(FRAME_DATA, i, data[off:off + chunk])
+              for i, off in enumerate(range(0, len(data), chunk))]
+    frames.append(frame(FRAME_END, len(frames)))
+
+    base = 0
+    sent = 0
+    resends = 0
+    start = time.monotonic()
+    while True:
+        while sent < len(frames) and sent - base < window:
+            port.write(frames[sent])
+            sent += 1
+
+        reply = link.reply(timeout)
+        if reply is None:
+            # Lost frames or acks, go back to the oldest unacked frame
+            resends += sent - base
+            sent = base
+            continue
+        kind, value, _ = reply
+        if kind == "A":
+            base = max(base, unwrap(int(value, 16), base) + 1)
+        elif kind == "N":
+            resends += sent - base
+            base = max(base, unwrap(int(value, 16), base))
+            sent = base
+        elif kind == "D":
+            break
+        elif kind == "E":
+            sys.exit("upload failed: %s" % value.decode())
+
+    elapsed = time.monotonic() - start
+    print("%s: %d bytes in %.1f s (%.0f B/s, %d frames resent)" %
+          (remote, len(data), elapsed, len(data) / elapsed, resends))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("port")
+    parser.add_argument("local")
+    parser.add_argument("remote", help="path on the card, e.g. SONGS/FISH.WAV")
+    parser.add_argument("--baud", type=int, default=115200)
+    args = parser.parse_args()
+
+    with open(args.local, "rb") as f:
+        data = f.read()
+    with serial.Serial(args.port, args.baud, timeout=0.1) as port:
+        try:
+            upload(port, data, args.remote, args.baud)
+        except KeyboardInterrupt:
+            port.write(frame(FRAME_ABORT, 0))
+            raise
+
+
+if __name__ == "__main__":
+    main()
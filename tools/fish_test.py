@@ -0,0 +1,238 @@
+#!/usr/bin/env python3
+"""Exercise a fish from the host over its shell UART.
+
+    fish_test.py PORT CHECK...
+
+A song is generated and uploaded with tools/bmbb_upload.py to
+SONGS/TEST.WAV, then each check runs against it:
+
+    busy    play the song while the shell is kept busy with commands and
+            fail on any I2S underrun
+    jitter  play the song on every fish wired to the controller and fail
+            if a move fires more than --max-late ms late
+    bench   play the song until it's in the cache and compare reading it
+            from the SD card and from the cache with bmbb bench
+    upload  send a file with --corrupt of the frames damaged or dropped on
+            the way, then check a new song pack is held back for a reboot
+
+Needs pyserial.
+"""
+
+import argparse
+import io
+import math
+import os
+import random
+import re
+import struct
+import sys
+import time
+import wave
+
+import serial
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import bmbb_upload  # noqa: E402
+
+PROMPT = b"uart:~$ "
+ANSI = re.compile(r"\x1b\[[0-9;]*[A-Za-z]")
+
+SAMPLE_RATE = 44100
+SONG = "SONGS/TEST"
+
+
+class Fish:
+    def __init__(self, port, baud):
+        self.port = port
+        self.baud = baud
+
+    def command(self, line, timeout=5.0):
+        """Run a shell command and return what it printed."""
+        self.port.reset_input_buffer()
+        self.port.write(line.encode() + b"\r\n")
+        out = b""
+        deadline = time.monotonic() + timeout
+        # The echo follows the old prompt, a new one means the command is done
+        while not out.endswith(PROMPT):
+            if time.monotonic() > deadline:
+                raise TimeoutError("no prompt after %r: %r" % (line, out))
+            out += self.port.read(self.port.in_waiting or 1)
+        return ANSI.sub("", out.decode(errors="replace"))
+
+    def upload(self, data, remote):
+        bmbb_upload.upload(self.port, data, remote, self.baud)
+        # Let the shell come back before the next command
+        time.sleep(0.2)
+
+    def stat(self, name):
+        match = re.search(r"^%s: (\d+)" % re.escape(name), self.command("bmbb stats"),
+                          re.MULTILINE)
+        if match is None:
+            raise RuntimeError("no %s in bmbb stats" % name)
+        return int(match.group(1))
+
+    def select(self, wav):
+        """Step through the song list until wav is next."""
+        for _ in range(64):
+            if wav in self.command("bmbb next"):
+                return
+        raise RuntimeError("%s never came up in the song list" % wav)
+
+
+class NoisyLink:
+    """Damages or drops frames on their way to the fish like a bad UART."""
+
+    def __init__(self, port, rate):
+        self.port = port
+        self.rate = rate
+        self.random = random.Random(1)
+
+    def write(self, data):
+        if data[:1] == bytes([bmbb_upload.SOF]) and self.random.random() < self.rate:
+            if self.random.random() < 0.5:
+                return
+            data = bytearray(data)
+            data[self.random.randrange(len(data))] ^= 0x40
+        self.port.write(bytes(data))
+
+    def __getattr__(self, name):
+        return getattr(self.port, name)
+
+
+def make_wav(seconds):
+    out = io.BytesIO()
+    with wave.open(out, "wb") as w:
+        w.setnchannels(1)
+        w.setsampwidth(2)
+        w.setframerate(SAMPLE_RATE)
+        w.writeframes(b"".join(
+            struct.pack("<h", int(8000 * math.sin(2 * math.pi * 440 * i / SAMPLE_RATE)))
+            for i in range(int(seconds * SAMPLE_RATE))))
+    return out.getvalue()
+
+
+def make_dat(seconds):
+    """A mouth move every 300 ms and the head and tail taking turns."""
+    lines = []
+    for ms in range(0, int(seconds * 1000), 300):
+        lines.append("M%06d" % ms)
+    for ms in range(0, int(seconds * 1000), 2000):
+        lines.append("H%06d" % ms)
+        lines.append("R%06d" % (ms + 1000))
+        lines.append("T%06d" % (ms + 1500))
+    lines.sort(key=lambda line: int(line[1:]))
+    return ("\n".join(lines) + "\n").encode()
+
+
+def check_busy(fish, args):
+    fish.command("bmbb stats reset")
+    fish.select(SONG + ".WAV")
+    fish.command("bmbb play")
+    commands = 0
+    end = time.monotonic() + args.seconds
+    while time.monotonic() < end:
+        fish.command("fs ls /SD:/SONGS")
+        fish.command("bmbb cache")
+        commands += 2
+    underruns = fish.stat("Underruns")
+    near = fish.stat("Near underruns")
+    print("busy: %d commands while playing, %d underruns, %d near underruns" %
+          (commands, underruns, near))
+    return underruns == 0
+
+
+def check_jitter(fish, args):
+    fish.command("bmbb stats reset")
+    fish.select(SONG + ".WAV")
+    fish.command("bmbb play")
+    time.sleep(args.seconds + 1.0)
+    stats = fish.command("bmbb stats")
+    events = re.search(r"Motor events: (\d+) across (\d+) fish", stats)
+    late = re.search(r"Motor lateness: avg (-?\d+) ms, max (-?\d+) ms", stats)
+    if events is None or late is None:
+        raise RuntimeError("no motor stats: %r" % stats)
+    print("jitter: %s events across %s fish, avg %s ms late, max %s ms" %
+          (events.group(1), events.group(2), late.group(1), late.group(2)))
+    return int(late.group(2)) <= args.max_late
+
+
+def check_bench(fish, args):
+    wav = "/SD:/" + SONG + ".WAV"
+    fish.select(SONG + ".WAV")
+    # The cache only takes a file once it's been played a few times
+    for _ in range(args.cache_plays):
+        fish.command("bmbb play")
+        time.sleep(args.seconds + 1.0)
+    deadline = time.monotonic() + 60.0
+    while not re.search(r"%s .*cached" % re.escape(wav), fish.command("bmbb cache")):
+        if time.monotonic() > deadline:
+            print("bench: %s never made it into the cache" % wav)
+            return False
+        time.sleep(1.0)
+    out = fish.command("bmbb bench %s" % wav, timeout=30.0)
+    tiers = re.findall(r"^(\w+): read (\d+) bytes in (\d+) us \((\d+) KiB/s\)", out,
+                       re.MULTILINE)
+    for tier, size, us, rate in tiers:
+        print("bench: %s %s bytes in %s us, %s KiB/s" % (tier, size, us, rate))
+    return len(tiers) == 2
+
+
+def check_upload(fish, args):
+    data = random.Random(2).randbytes(64 * 1024)
+    try:
+        bmbb_upload.upload(NoisyLink(fish.port, args.corrupt), data, "UPTEST.BIN", args.baud)
+        time.sleep(0.2)
+        # The pack is held open, a new one has to wait beside it
+        bmbb_upload.upload(fish.port, data[:1024], "BMBB.PAK", args.baud)
+        time.sleep(0.2)
+    except SystemExit as e:
+        print("upload: %s" % e)
+        return False
+    listing = fish.command("fs ls /SD:")
+    fish.command("fs rm /SD:/UPTEST.BIN")
+    fish.command("fs rm /SD:/BMBB.NEW")
+    ok = "UPTEST.BIN" in listing and "BMBB.NEW" in listing
+    print("upload: %d bytes with %.0f%% of frames damaged, pack %s" %
+          (len(data), args.corrupt * 100, "deferred" if "BMBB.NEW" in listing else "not deferred"))
+    return ok
+
+
+CHECKS = {
+    "busy": check_busy,
+    "jitter": check_jitter,
+    "bench": check_bench,
+    "upload": check_upload,
+}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("port", help="serial port of the fish's shell")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--seconds", type=float, default=10.0, help="length of the song")
+    parser.add_argument("--max-late", type=int, default=10,
+                        help="latest a move may fire for jitter, in ms")
+    parser.add_argument("--cache-plays", type=int, default=2,
+                        help="plays before a file is cached, CONFIG_APP_CACHE_MIN_PLAYS")
+    parser.add_argument("--corrupt", type=float, default=0.05,
+                        help="share of upload frames to damage or drop")
+    parser.add_argument("checks", nargs="+", choices=sorted(CHECKS))
+    args = parser.parse_args()
+
+    with serial.Serial(args.port, args.baud, timeout=0.1) as link:
+        fish = Fish(link, args.baud)
+        # Drop the colors so the output parses
+        fish.command("shell colors off")
+        fish.command("fs mkdir /SD:/SONGS")
+        fish.upload(make_dat(args.seconds), SONG + ".DAT")
+        fish.upload(make_wav(args.seconds), SONG + ".WAV")
+
+        failed = [name for name in args.checks if not CHECKS[name](fish, args)]
+
+    if failed:
+        sys.exit("failed: %s" % ", ".join(failed))
+    print("all passed")
+
+
+if __name__ == "__main__":
+    main()
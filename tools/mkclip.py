@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""Turn a wav into a clip that can be linked into the firmware.
+
+    mkclip.py [--adpcm] IN.WAV OUT.BIN
+
+The output is a struct clip_header (see src/clip.c) followed by the samples,
+either 16 bit PCM or IMA ADPCM in the block layout of src/adpcm.h.  The
+build runs this for CONFIG_APP_DEFAULT_SONG_WAV.
+"""
+
+import argparse
+import struct
+import sys
+import wave
+
+FORMAT_PCM = 1
+FORMAT_IMA_ADPCM = 0x11
+
+ADPCM_BLOCK_SIZE = 256
+ADPCM_SAMPLES_PER_BLOCK = (ADPCM_BLOCK_SIZE - 4) * 2 + 1
+
+STEP_TABLE = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+]
+INDEX_TABLE = [-1, -1, -1, -1, 2, 4, 6, 8] * 2
+
+
+def decode_nibble(nibble, predictor, index):
+    """Must match decode_nibble() in src/adpcm.c exactly."""
+    step = STEP_TABLE[index]
+    diff = step >> 3
+    if nibble & 1:
+        diff += step >> 2
+    if nibble & 2:
+        diff += step >> 1
+    if nibble & 4:
+        diff += step
+    predictor += -diff if nibble & 8 else diff
+    predictor = max(-32768, min(32767, predictor))
+    index = max(0, min(len(STEP_TABLE) - 1, index + INDEX_TABLE[nibble]))
+    return predictor, index
+
+
+def encode_block(samples, index):
+    predictor = samples[0]
+    out = bytearray(struct.pack("<hBB", predictor, index, 0))
+    nibbles = []
+    for sample in samples[1:]:
+        step = STEP_TABLE[index]
+        diff = sample - predictor
+        nibble = 0
+        if diff < 0:
+            nibble = 8
+            diff = -diff
+        if diff >= step:
+            nibble |= 4
+            diff -= step
+        if diff >= step >> 1:
+            nibble |= 2
+            diff -= step >> 1
+        if diff >= step >> 2:
+            nibble |= 1
+        predictor, index = decode_nibble(nibble, predictor, index)
+        nibbles.append(nibble)
+    if len(nibbles) % 2:
+        nibbles.append(0)
+    for i in range(0, len(nibbles), 2):
+        out.append(nibbles[i] | nibbles[i + 1] << 4)
+    return out, index
+
+
+def encode_adpcm(samples):
+    out = bytearray()
+    index = 0
+    for start in range(0, len(samples), ADPCM_SAMPLES_PER_BLOCK):
+        block, index = encode_block(samples[start:start + ADPCM_SAMPLES_PER_BLOCK], index)
+        out += block
+    return out
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--adpcm", action="store_true", help="compress with IMA ADPCM")
+    parser.add_argument("wav")
+    parser.add_argument("output")
+    args = parser.parse_args()
+
+    with wave.open(args.wav, "rb") as w:
+        if w.getnchannels() != 1 or w.getsampwidth() != 2 or w.getframerate() != 44100:
+            sys.exit("%s must be mono PCM, 16 bits per sample, 44100" % args.wav)
+        data = w.readframes(w.getnframes())
+    count = len(data) // 2
+
+    if args.adpcm:
+        samples = struct.unpack("<%dh" % count, data[:count * 2])
+        body = encode_adpcm(samples)
+        header = struct.pack("<IHH", count, FORMAT_IMA_ADPCM, ADPCM_BLOCK_SIZE)
+    else:
+        body = data[:count * 2]
+        header = struct.pack("<IHH", count, FORMAT_PCM, 0)
+
+    with open(args.output, "wb") as f:
+        f.write(header + body)
+    print("%s: %d samples, %d bytes" % (args.output, count, len(header) + len(body)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""Build a BMBB.PAK song pack from a directory laid out like the SD card.
+
+    mkpak.py SD_ROOT [-o BMBB.PAK] [--align 32768]
+
+Every SONGS/X.WAV and JOKES/X.WAV with a matching X.DAT is added, along with
+X.1.DAT, X.2.DAT, ... for the other fish.  See src/pack.h for the layout.
+
+Copy the result to the root of a freshly formatted card so it lands in one
+contiguous run; --align should match the card's cluster size.
+"""
+
+import argparse
+import os
+import struct
+import sys
+import wave
+
+PACK_MAGIC = 0x4B415042  # "BPAK"
+PACK_VERSION = 1
+PACK_NAME_MAX = 32
+PACK_MAX_FISH = 4
+
+HEADER = struct.Struct("<IHHI")
+EXTENT = struct.Struct("<II")
+ENTRY = struct.Struct("<%dsBBH" % PACK_NAME_MAX + "8s" * (1 + PACK_MAX_FISH))
+
+MODES = (("SONGS", 0), ("JOKES", 1))
+
+
+def wav_bytes(path):
+    """The samples behind a plain 44 byte header, whatever the file had."""
+    with wave.open(path, "rb") as w:
+        if w.getnchannels() != 1 or w.getsampwidth() != 2 or w.getframerate() != 44100:
+            raise ValueError("%s must be mono PCM, 16 bits per sample, 44100" % path)
+        data = w.readframes(w.getnframes())
+    return struct.pack("<4sI4s4sIHHIIHH4sI", b"RIFF", 36 + len(data), b"WAVE",
+                       b"fmt ", 16, 1, 1, 44100, 44100 * 2, 2, 16,
+                       b"data", len(data)) + data
+
+
+def find_tracks(root):
+    tracks = []
+    for folder, mode in MODES:
+        path = os.path.join(root, folder)
+        if not os.path.isdir(path):
+            continue
+        for name in sorted(os.listdir(path)):
+            base, ext = os.path.splitext(name)
+            if ext.upper() != ".WAV":
+                continue
+            # A fish without a script of its own follows the first one
+            dats = []
+            for fish in range(PACK_MAX_FISH):
+                dat = os.path.join(path, base + (".%d" % fish if fish else "") + ".DAT")
+                dats.append(dat if os.path.isfile(dat) else None)
+            while dats and dats[-1] is None:
+                dats.pop()
+            if not dats or dats[0] is None:
+                print("skipping %s/%s, no .DAT" % (folder, name), file=sys.stderr)
+                continue
+            label = "%s/%s" % (folder, name)
+            if len(label) >= PACK_NAME_MAX:
+                raise ValueError("%s is longer than %d characters" % (label, PACK_NAME_MAX - 1))
+            tracks.append((label, mode, os.path.join(path, name), dats))
+    return tracks
+
+
+def align_up(value, align):
+    return (value + align - 1) // align * align
+
+
+def build(tracks, align):
+    scripts = []
+    dat_extents = []
+    offset = HEADER.size + ENTRY.size * len(tracks)
+    for _, _, _, dats in tracks:
+        extents = []
+        for dat in dats:
+            if dat is None:
+                extents.append((0, 0))
+                continue
+            with open(dat, "rb") as f:
+                data = f.read()
+            scripts.append(data)
+            extents.append((offset, len(data)))
+            offset += len(data)
+        extents += [(0, 0)] * (PACK_MAX_FISH - len(extents))
+        dat_extents.append(extents)
+
+    wavs = []
+    for _, _, wav, _ in tracks:
+        offset = align_up(offset, align)
+        data = wav_bytes(wav)
+        wavs.append((offset, data))
+        offset += len(data)
+    if offset > 0xFFFFFFFF:
+        raise ValueError("pack would be larger than 4 GB")
+
+    out = bytearray(HEADER.pack(PACK_MAGIC, PACK_VERSION, len(tracks), align))
+    for (label, mode, _, dats), extents, (wav_offset, wav) in zip(tracks, dat_extents, wavs):
+        out += ENTRY.pack(label.encode(), mode, len(dats), 0,
+                          EXTENT.pack(wav_offset, len(wav)),
+                          *(EXTENT.pack(*e) for e in extents))
+    for data in scripts:
+        out += data
+    for wav_offset, wav in wavs:
+        out += bytes(wav_offset - len(out))
+        out += wav
+    return out
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("root", help="directory holding SONGS/ and JOKES/")
+    parser.add_argument("-o", "--output", default="BMBB.PAK")
+    parser.add_argument("--align", type=int, default=32768,
+                        help="start each wav on this boundary (default %(default)s)")
+    args = parser.parse_args()
+
+    tracks = find_tracks(args.root)
+    if not tracks:
+        sys.exit("no tracks found under %s" % args.root)
+    if len(tracks) > 0xFFFF:
+        sys.exit("too many tracks")
+    pak = build(tracks, args.align)
+    with open(args.output, "wb") as f:
+        f.write(pak)
+    print("%s: %d tracks, %d bytes" % (args.output, len(tracks), len(pak)))
+
+
+if __name__ == "__main__":
+    main()